@@ -1,101 +1,349 @@
 #include "bvh.h"
+#include <algorithm>
+#include <array>
+#include <limits>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-std::pair<float, uint32_t> BVH::bestSplit(std::vector<Figure> &figures, uint32_t first, uint32_t last) const {
-    std::vector<float> all(last - first, 0);
-    AABB pref(figures[first]);
-    for (size_t i = 1; i < last - first; i++) {
-        all[i] = pref.area() * i;
-        pref.extend(figures[first + i]);
+std::vector<uint32_t> BVH::build(const std::vector<AABB> &bounds, uint32_t batch) {
+    uint32_t n = bounds.size();
+    std::vector<PrimitiveRef> refs(n);
+#pragma omp parallel for schedule(static)
+    for (uint32_t i = 0; i < n; i++) {
+        refs[i].aabb = bounds[i];
+        refs[i].centroid = 0.5f * (bounds[i].min + bounds[i].max);
+        refs[i].index = i;
     }
 
-    AABB suff(figures[last - 1]);
-    for (size_t i = last - first - 1; i >= 1; i--) {
-        all[i] += suff.area() * ((last - first) - i);
-        suff.extend(figures[first + i - 1]);
+    nodes.clear();
+    if (n != 0) {
+        nodes.reserve(2 * n);
+#pragma omp parallel
+#pragma omp single
+        buildNode(refs, 0, n, 0, batch, nodes);
     }
 
-    std::pair<float, uint32_t> ans = {all[1], first + 1};
-    for (size_t i = 2; i < last - first; i++) {
-        if (all[i] < ans.first) {
-            ans = {all[i], first + i};
-        }
+    std::vector<uint32_t> order(n);
+#pragma omp parallel for schedule(static)
+    for (uint32_t i = 0; i < n; i++) {
+        order[i] = refs[i].index;
     }
-    return ans;
+    return order;
 }
 
-void BVH::half(std::vector<Figure> &figures, uint32_t first, uint32_t last, int axis) {
-    auto cmp = axis == 0 ? [](const Figure &lhs, const Figure &rhs) { return lhs.position.x < rhs.position.x; } :
-               (axis == 1 ? [](const Figure &lhs, const Figure &rhs) { return lhs.position.y < rhs.position.y; } :
-                [](const Figure &lhs, const Figure &rhs) { return lhs.position.z < rhs.position.z; });
-    std::sort(figures.begin() + first, figures.begin() + last, cmp);
+// Splits [first, last) into BLOCK_SIZE blocks reduced by separate tasks. Partial
+// results are merged in block order, and both merges below only take minimums,
+// maximums and integer sums, so the result does not depend on the thread count.
+template <typename T, typename Body>
+static T reduceBlocks(uint32_t first, uint32_t last, const Body &body) {
+    uint32_t blocks = (last - first + BVH::BLOCK_SIZE - 1) / BVH::BLOCK_SIZE;
+    if (blocks <= 1) {
+        return body(first, last);
+    }
+
+    std::vector<T> partial(blocks);
+    for (uint32_t b = 0; b < blocks; b++) {
+#pragma omp task default(none) firstprivate(b, first, last) shared(partial, body)
+        partial[b] = body(first + b * BVH::BLOCK_SIZE, std::min(last, first + (b + 1) * BVH::BLOCK_SIZE));
+    }
+#pragma omp taskwait
+
+    for (uint32_t b = 1; b < blocks; b++) {
+        partial[0].merge(partial[b]);
+    }
+    return partial[0];
 }
 
-uint32_t BVH::build(std::vector<Figure> &figures, uint32_t first, uint32_t last) {
-    Node cur = Node(first, last);
+// Partitions [first, last) by pred and returns the start of the right part.
+// Ranges of several BLOCK_SIZE blocks are split like reduceBlocks: every block
+// counts its elements that go left in its own task, a prefix sum over the
+// blocks gives each block where its elements go, and the blocks scatter into a
+// buffer in parallel. The result is the same for any number of threads.
+template <typename Pred>
+static uint32_t partitionBlocks(std::vector<PrimitiveRef> &refs, uint32_t first, uint32_t last, const Pred &pred) {
+    uint32_t blocks = (last - first + BVH::BLOCK_SIZE - 1) / BVH::BLOCK_SIZE;
+    if (blocks <= 1) {
+        return std::partition(refs.begin() + first, refs.begin() + last, pred) - refs.begin();
+    }
+    auto blockStart = [&](uint32_t b) { return first + b * BVH::BLOCK_SIZE; };
+    auto blockEnd = [&](uint32_t b) { return std::min(last, first + (b + 1) * BVH::BLOCK_SIZE); };
+
+    std::vector<uint32_t> leftCounts(blocks);
+    for (uint32_t b = 0; b < blocks; b++) {
+#pragma omp task default(none) firstprivate(b) shared(refs, pred, leftCounts, blockStart, blockEnd)
+        leftCounts[b] = std::count_if(refs.begin() + blockStart(b), refs.begin() + blockEnd(b), pred);
+    }
+#pragma omp taskwait
+
+    std::vector<uint32_t> leftOffsets(blocks), rightOffsets(blocks);
+    uint32_t left = 0;
+    for (uint32_t b = 0; b < blocks; b++) {
+        leftOffsets[b] = left;
+        left += leftCounts[b];
+    }
+    uint32_t right = left;
+    for (uint32_t b = 0; b < blocks; b++) {
+        rightOffsets[b] = right;
+        right += blockEnd(b) - blockStart(b) - leftCounts[b];
+    }
+
+    std::vector<PrimitiveRef> scattered(last - first);
+    for (uint32_t b = 0; b < blocks; b++) {
+#pragma omp task default(none) firstprivate(b) shared(refs, pred, scattered, leftOffsets, rightOffsets, blockStart, blockEnd)
+        {
+            uint32_t l = leftOffsets[b], r = rightOffsets[b];
+            for (uint32_t i = blockStart(b); i < blockEnd(b); i++) {
+                scattered[pred(refs[i]) ? l++ : r++] = refs[i];
+            }
+        }
+    }
+#pragma omp taskwait
+
+    for (uint32_t b = 0; b < blocks; b++) {
+#pragma omp task default(none) firstprivate(b, first) shared(refs, scattered, blockStart, blockEnd)
+        std::copy(scattered.begin() + (blockStart(b) - first), scattered.begin() + (blockEnd(b) - first),
+                  refs.begin() + blockStart(b));
+    }
+#pragma omp taskwait
+    return first + left;
+}
+
+struct RangeBounds {
     AABB aabb;
-    if (first < last) {
-        aabb = AABB(figures[first]);
-        for (uint32_t i = first + 1; i < last; i++) {
-            aabb.extend(figures[i]);
+    AABB centroids;
+
+    void merge(const RangeBounds &other) {
+        aabb.extend(other.aabb);
+        centroids.extend(other.centroids);
+    }
+};
+
+static int binIndex(const PrimitiveRef &ref, const AABB &centroids, int axis) {
+    float extent = centroids.max[axis] - centroids.min[axis];
+    int bin = int(BVH::BINS * (ref.centroid[axis] - centroids.min[axis]) / extent);
+    return std::min(bin, BVH::BINS - 1);
+}
+
+class BVHBins {
+public:
+    std::array<std::array<AABB, BVH::BINS>, 3> aabbs;
+    std::array<std::array<uint32_t, BVH::BINS>, 3> counts{};
+
+    void add(const PrimitiveRef &ref, const AABB &centroids) {
+        for (int axis = 0; axis < 3; ++axis) {
+            if (centroids.max[axis] <= centroids.min[axis]) {
+                continue;
+            }
+            int bin = binIndex(ref, centroids, axis);
+            aabbs[axis][bin].extend(ref.aabb);
+            counts[axis][bin]++;
         }
     }
-    cur.aabb = aabb;
-    uint32_t thisPos = nodes.size();
-    nodes.push_back(cur);
-    if (last - first <= 1) {
-        return thisPos;
+
+    void merge(const BVHBins &other) {
+        for (int axis = 0; axis < 3; ++axis) {
+            for (int i = 0; i < BVH::BINS; i++) {
+                aabbs[axis][i].extend(other.aabbs[axis][i]);
+                counts[axis][i] += other.counts[axis][i];
+            }
+        }
     }
+};
+
+// Number of batches count primitives are tested in.
+static float batches(uint32_t count, uint32_t batch) {
+    return (count + batch - 1) / batch;
+}
+
+BinnedSplit BVH::bestSplit(const BVHBins &bins, uint32_t count, uint32_t batch) {
+    BinnedSplit ans = {std::numeric_limits<float>::infinity(), -1, 0};
 
     for (int axis = 0; axis < 3; ++axis) {
-        half(figures, first, last, axis);
-        auto split = bestSplit(figures, first, last);
-        float bestResult = split.first;
-        if (bestResult >= aabb.area() * (last - first)) {
-            continue;
+        const auto &aabbs = bins.aabbs[axis];
+        const auto &counts = bins.counts[axis];
+
+        // all[i] is the cost of putting bins [0, i) to the left and [i, BINS) to the right.
+        std::array<float, BINS> all{};
+        AABB pref;
+        uint32_t prefCount = 0;
+        for (int i = 1; i < BINS; i++) {
+            pref.extend(aabbs[i - 1]);
+            prefCount += counts[i - 1];
+            all[i] = prefCount == 0 ? 0 : pref.area() * batches(prefCount, batch);
+        }
+
+        AABB suff;
+        uint32_t suffCount = 0;
+        for (int i = BINS - 1; i >= 1; i--) {
+            suff.extend(aabbs[i]);
+            suffCount += counts[i];
+            if (suffCount == 0 || suffCount == count) {
+                continue;
+            }
+            all[i] += suff.area() * batches(suffCount, batch);
+            if (all[i] < ans.cost) {
+                ans = {all[i], axis, i};
+            }
         }
-        uint32_t mid = split.second;
-        nodes[thisPos].left = build(figures, first, mid);
-        nodes[thisPos].right = build(figures, mid, last);
-        return thisPos;
     }
-    return thisPos;
+    return ans;
 }
 
-std::optional<std::pair<Intersection, int>> BVH::intersectInner(const std::vector<Figure> &figures, uint32_t pos, const Ray &ray,
-                                                                std::optional<float> curBest) const {
-    const Node &cur = nodes[pos];
-    auto intersection = cur.aabb.intersect(ray);
-    if (!intersection.has_value()) {
-        return {};
+// Appends a subtree built into its own array, shifting its right child links.
+static uint32_t appendSubtree(std::vector<Node> &out, const std::vector<Node> &subtree) {
+    uint32_t shift = out.size();
+    for (Node node : subtree) {
+        if (!node.isLeaf()) {
+            node.offset += shift;
+        }
+        out.push_back(node);
     }
+    return shift;
+}
 
-    auto [t, _, isInside] = intersection.value();
-    if (curBest.has_value() && curBest.value() < t && !isInside) {
-        return {};
+// Nodes are laid out in depth-first order (node, left subtree, right subtree) both
+// when the children are built in place and when they are built as tasks and
+// appended afterwards, so the node array is the same for any number of threads.
+void BVH::buildNode(std::vector<PrimitiveRef> &refs, uint32_t first, uint32_t last, int depth, uint32_t batch,
+                    std::vector<Node> &out) {
+    auto bounds = reduceBlocks<RangeBounds>(first, last, [&](uint32_t from, uint32_t to) {
+        RangeBounds result;
+        for (uint32_t i = from; i < to; i++) {
+            result.aabb.extend(refs[i].aabb);
+            result.centroids.extend(refs[i].centroid);
+        }
+        return result;
+    });
+    Node cur;
+    cur.min = bounds.aabb.min;
+    cur.max = bounds.aabb.max;
+    cur.offset = first;
+    cur.count = last - first;
+    uint32_t thisPos = out.size();
+    out.push_back(cur);
+    if (last - first <= 1 || depth + 1 >= MAX_DEPTH) {
+        return;
     }
 
-    std::optional<std::pair<Intersection, int>> bestIntersection = {};
-
-    if (cur.left == 0) {
-        for (uint32_t i = cur.first; i < cur.last; i++) {
-            auto curIntersection = figures[i].intersect(ray);
-            if (curIntersection.has_value() && (!bestIntersection.has_value() || curIntersection.value().t < bestIntersection.value().first.t)) {
-                bestIntersection = {curIntersection.value(), static_cast<int>(i)};
-            }
+    const AABB &centroids = bounds.centroids;
+    auto bins = reduceBlocks<BVHBins>(first, last, [&](uint32_t from, uint32_t to) {
+        BVHBins result;
+        for (uint32_t i = from; i < to; i++) {
+            result.add(refs[i], centroids);
         }
-        return bestIntersection;
+        return result;
+    });
+    auto split = bestSplit(bins, last - first, batch);
+    if (split.axis < 0 || split.cost >= bounds.aabb.area() * batches(last - first, batch)) {
+        return;
+    }
+
+    uint32_t mid = partitionBlocks(refs, first, last, [&](const PrimitiveRef &ref) {
+        return binIndex(ref, centroids, split.axis) < split.bin;
+    });
+
+    uint32_t right;
+    if (last - first < TASK_THRESHOLD) {
+        buildNode(refs, first, mid, depth + 1, batch, out);
+        right = out.size();
+        buildNode(refs, mid, last, depth + 1, batch, out);
+    } else {
+        std::vector<Node> leftNodes, rightNodes;
+#pragma omp task default(none) firstprivate(first, mid, depth, batch) shared(refs, leftNodes)
+        buildNode(refs, first, mid, depth + 1, batch, leftNodes);
+#pragma omp task default(none) firstprivate(mid, last, depth, batch) shared(refs, rightNodes)
+        buildNode(refs, mid, last, depth + 1, batch, rightNodes);
+#pragma omp taskwait
+        appendSubtree(out, leftNodes);
+        right = appendSubtree(out, rightNodes);
+    }
+    out[thisPos].offset = right;
+    out[thisPos].count = 0;
+}
+
+void BVH::widen(int requested) {
+    nodes4.clear();
+    nodes8.clear();
+    width = 2;
+    if (nodes.empty() || requested <= 2) {
+        return;
+    }
+    if (requested >= 8 && cpuSupportsAvx2()) {
+        collapse<8>(0, nodes8);
+        width = 8;
+    } else {
+        collapse<4>(0, nodes4);
+        width = 4;
     }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
 
-    auto leftIntersection = intersectInner(figures, cur.left, ray, curBest);
-    if (leftIntersection.has_value() && (!curBest.has_value() || leftIntersection.value().first.t < curBest.value())) {
-        bestIntersection = leftIntersection;
-        curBest = leftIntersection.value().first.t;
+bool cpuSupportsAvx2() {
+    return __builtin_cpu_supports("avx2");
+}
+
+int intersectChildren(const WideNode<4> &node, const WideRay &ray, float tMax, float *dist) {
+    __m128 tNear = _mm_setzero_ps();
+    __m128 tFar = _mm_set1_ps(tMax);
+    for (int axis = 0; axis < 3; axis++) {
+        __m128 o = _mm_set1_ps(ray.o[axis]);
+        __m128 invD = _mm_set1_ps(ray.invD[axis]);
+        __m128 near = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[ray.near[axis]]), o), invD);
+        __m128 far = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[ray.far[axis]]), o), invD);
+        tNear = _mm_max_ps(tNear, near);
+        tFar = _mm_min_ps(tFar, far);
     }
+    _mm_store_ps(dist, tNear);
+    return _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+}
 
-    auto rightIntersection = intersectInner(figures, cur.right, ray, curBest);
-    if (rightIntersection.has_value() && (!bestIntersection.has_value() || rightIntersection.value().first.t < bestIntersection.value().first.t)) {
-        bestIntersection = rightIntersection;
+__attribute__((target("avx2")))
+int intersectChildren(const WideNode<8> &node, const WideRay &ray, float tMax, float *dist) {
+    __m256 tNear = _mm256_setzero_ps();
+    __m256 tFar = _mm256_set1_ps(tMax);
+    for (int axis = 0; axis < 3; axis++) {
+        __m256 o = _mm256_set1_ps(ray.o[axis]);
+        __m256 invD = _mm256_set1_ps(ray.invD[axis]);
+        __m256 near = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray.near[axis]]), o), invD);
+        __m256 far = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray.far[axis]]), o), invD);
+        tNear = _mm256_max_ps(tNear, near);
+        tFar = _mm256_min_ps(tFar, far);
     }
+    _mm256_store_ps(dist, tNear);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ));
+}
+
+#else
 
-    return bestIntersection;
+bool cpuSupportsAvx2() {
+    return false;
 }
+
+template <int N>
+static int intersectChildrenScalar(const WideNode<N> &node, const WideRay &ray, float tMax, float *dist) {
+    int mask = 0;
+    for (int i = 0; i < N; i++) {
+        float tNear = 0, tFar = tMax;
+        for (int axis = 0; axis < 3; axis++) {
+            tNear = std::max(tNear, (node.bounds[ray.near[axis]][i] - ray.o[axis]) * ray.invD[axis]);
+            tFar = std::min(tFar, (node.bounds[ray.far[axis]][i] - ray.o[axis]) * ray.invD[axis]);
+        }
+        dist[i] = tNear;
+        if (tNear <= tFar) {
+            mask |= 1 << i;
+        }
+    }
+    return mask;
+}
+
+int intersectChildren(const WideNode<4> &node, const WideRay &ray, float tMax, float *dist) {
+    return intersectChildrenScalar(node, ray, tMax, dist);
+}
+
+int intersectChildren(const WideNode<8> &node, const WideRay &ray, float tMax, float *dist) {
+    return intersectChildrenScalar(node, ray, tMax, dist);
+}
+
+#endif
@@ -7,37 +7,317 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <array>
 
-class Node {
+// Nodes are stored in depth-first order, so the left child of an interior node
+// always directly follows it. An interior node keeps the index of its right
+// child in offset and has count == 0, a leaf keeps its figures [offset, offset + count).
+class alignas(32) Node {
 public:
-    AABB aabb;
-    uint32_t left = 0, right = 0, first, last;
+    Point min;
+    uint32_t offset = 0;
+    Point max;
+    uint32_t count = 0;
 
     Node() {}
-    Node(uint32_t first, uint32_t last): first(first), last(last) {}
+
+    bool isLeaf() const;
+    AABB aabb() const;
+    float entry(const Point &o, const Point &invD, float tMax) const;
+};
+
+inline bool Node::isLeaf() const {
+    return count != 0;
+}
+
+inline AABB Node::aabb() const {
+    AABB result;
+    result.min = min;
+    result.max = max;
+    return result;
+}
+
+// Distance at which the ray enters the node's box (zero if it starts inside), or
+// infinity if the ray misses the box or enters it further than tMax.
+inline float Node::entry(const Point &o, const Point &invD, float tMax) const {
+    float tx1 = (min.x - o.x) * invD.x, tx2 = (max.x - o.x) * invD.x;
+    float ty1 = (min.y - o.y) * invD.y, ty2 = (max.y - o.y) * invD.y;
+    float tz1 = (min.z - o.z) * invD.z, tz2 = (max.z - o.z) * invD.z;
+    float t1 = std::max(std::max(std::min(tx1, tx2), std::min(ty1, ty2)), std::max(std::min(tz1, tz2), 0.f));
+    float t2 = std::min(std::min(std::max(tx1, tx2), std::max(ty1, ty2)), std::min(std::max(tz1, tz2), tMax));
+    return t1 <= t2 ? t1 : INFINITY;
+}
+
+inline Point inverseDirection(const Point &d) {
+    return {1.f / d.x, 1.f / d.y, 1.f / d.z};
+}
+
+// Bounds and centroid of a primitive computed once before the build, so that
+// binning and partitioning never touch the primitives themselves.
+struct PrimitiveRef {
+    AABB aabb;
+    Point centroid;
+    uint32_t index;
 };
 
+// Up to N children with their bounds stored per axis, so that all of them are
+// tested against a ray at once. bounds[axis] holds the minimums and
+// bounds[3 + axis] the maximums; unused slots have empty bounds and never hit.
+// A child with count == 0 is the wide node at index child, otherwise it is a
+// leaf with figures [child, child + count).
+template <int N>
+class alignas(32) WideNode {
+public:
+    float bounds[6][N];
+    uint32_t child[N];
+    uint32_t count[N];
+
+    WideNode();
+};
+
+template <int N>
+inline WideNode<N>::WideNode() {
+    for (int i = 0; i < N; i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            bounds[axis][i] = INFINITY;
+            bounds[3 + axis][i] = -INFINITY;
+        }
+        child[i] = 0;
+        count[i] = 0;
+    }
+}
+
+// A ray prepared for wide node tests: for every axis, near and far select the
+// bounds row the ray enters and leaves through.
+class WideRay {
+public:
+    float o[3];
+    float invD[3];
+    int near[3], far[3];
+
+    WideRay(const Ray &ray);
+};
+
+inline WideRay::WideRay(const Ray &ray) {
+    Point invDir = inverseDirection(ray.d);
+    for (int axis = 0; axis < 3; axis++) {
+        o[axis] = ray.o[axis];
+        invD[axis] = invDir[axis];
+        near[axis] = invD[axis] < 0 ? 3 + axis : axis;
+        far[axis] = invD[axis] < 0 ? axis : 3 + axis;
+    }
+}
+
+// Slab tests the ray against all children of a node. Returns the mask of children
+// entered no further than tMax and writes their entry distances to dist.
+int intersectChildren(const WideNode<4> &node, const WideRay &ray, float tMax, float *dist);
+int intersectChildren(const WideNode<8> &node, const WideRay &ray, float tMax, float *dist);
+
+bool cpuSupportsAvx2();
+
+struct BinnedSplit {
+    float cost;
+    int axis;
+    int bin;
+};
+
+class BVHBins;
+
 class BVH {
 public:
+    static constexpr int BINS = 32;
+    // Ranges at least this large are built as separate OpenMP tasks.
+    static constexpr uint32_t TASK_THRESHOLD = 4096;
+    // Ranges at least this large get their bounds and bins computed by several tasks.
+    static constexpr uint32_t BLOCK_SIZE = 32768;
+    // Deeper ranges become leaves, which bounds the traversal stack.
+    static constexpr int MAX_DEPTH = 64;
+
     std::vector<Node> nodes;
-    uint32_t root;
+    // Set by widen(); 2 means the binary nodes are traversed directly.
+    int width = 2;
+    std::vector<WideNode<4>> nodes4;
+    std::vector<WideNode<8>> nodes8;
 
     BVH() {}
-    BVH(std::vector<Figure> &figures, uint32_t n) {
-        root = build(figures, 0, n);
+
+    // Builds over arbitrary primitives given by their bounds. Returns the order the
+    // leaves reference them in: leaf ranges index into order, and order[i] is the
+    // position of that primitive in bounds. If leaves test their primitives
+    // batch at a time, the surface area heuristic counts what a leaf costs in
+    // batches, which keeps together ranges that fit in one.
+    std::vector<uint32_t> build(const std::vector<AABB> &bounds, uint32_t batch = 1);
+
+    // Collapses the binary tree into 4- or 8-wide nodes used by all later traversals.
+    // Width 8 needs AVX2 and falls back to 4 on CPUs without it.
+    void widen(int requested);
+
+    // Calls leaf(first, count, best) for every leaf the ray enters closer than best,
+    // nearest first. The callback lowers best when it finds a closer hit; setting it
+    // below zero ends the traversal.
+    template <typename Leaf>
+    void traverse(const Ray &ray, float &best, Leaf &&leaf) const;
+
+    template <typename Leaf>
+    void traverseBinary(const Ray &ray, float &best, Leaf &leaf) const;
+
+    template <int N, typename Leaf>
+    static void traverseWide(const std::vector<WideNode<N>> &wide, const Ray &ray, float &best, Leaf &leaf);
+
+    template <int N>
+    uint32_t collapse(uint32_t pos, std::vector<WideNode<N>> &out) const;
+
+    static BinnedSplit bestSplit(const BVHBins &bins, uint32_t count, uint32_t batch);
+
+    static void buildNode(std::vector<PrimitiveRef> &refs, uint32_t first, uint32_t last, int depth,
+                          uint32_t batch, std::vector<Node> &out);
+};
+
+template <typename Leaf>
+void BVH::traverse(const Ray &ray, float &best, Leaf &&leaf) const {
+    if (width == 8) {
+        traverseWide<8>(nodes8, ray, best, leaf);
+    } else if (width == 4) {
+        traverseWide<4>(nodes4, ray, best, leaf);
+    } else {
+        traverseBinary(ray, best, leaf);
     }
+}
 
-    std::optional<std::pair<Intersection, int>> intersect(const std::vector<Figure> &figures, const Ray &ray,
-                                                          std::optional<float> curBest) const {
-        return intersectInner(figures, root, ray, curBest);
+template <typename Leaf>
+void BVH::traverseBinary(const Ray &ray, float &best, Leaf &leaf) const {
+    if (nodes.empty()) {
+        return;
     }
 
-    std::pair<float, uint32_t> bestSplit(std::vector<Figure> &figures, uint32_t first, uint32_t last) const;
+    Point invD = inverseDirection(ray.d);
 
-    static void half(std::vector<Figure> &figures, uint32_t first, uint32_t last, int axis) ;
+    // Pending far children together with their entry distances, so that they can
+    // be skipped once a closer hit has been found.
+    std::array<std::pair<uint32_t, float>, MAX_DEPTH> stack;
+    int stackSize = 0;
 
-    uint32_t build(std::vector<Figure> &figures, uint32_t first, uint32_t last);
+    uint32_t pos = 0;
+    if (nodes[0].entry(ray.o, invD, best) == INFINITY) {
+        return;
+    }
 
-    std::optional<std::pair<Intersection, int>> intersectInner(const std::vector<Figure> &figures, uint32_t pos,
-                                                               const Ray &ray, std::optional<float> curBest) const;
-};
+    while (true) {
+        const Node &cur = nodes[pos];
+        if (!cur.isLeaf()) {
+            uint32_t near = pos + 1, far = cur.offset;
+            float tNear = nodes[near].entry(ray.o, invD, best);
+            float tFar = nodes[far].entry(ray.o, invD, best);
+            if (tFar < tNear) {
+                std::swap(near, far);
+                std::swap(tNear, tFar);
+            }
+            if (tNear != INFINITY) {
+                if (tFar != INFINITY) {
+                    stack[stackSize++] = {far, tFar};
+                }
+                pos = near;
+                continue;
+            }
+        } else {
+            leaf(cur.offset, cur.count, best);
+        }
+
+        while (stackSize > 0 && stack[stackSize - 1].second > best) {
+            stackSize--;
+        }
+        if (stackSize == 0) {
+            return;
+        }
+        pos = stack[--stackSize].first;
+    }
+}
+
+template <int N, typename Leaf>
+void BVH::traverseWide(const std::vector<WideNode<N>> &wide, const Ray &ray, float &best, Leaf &leaf) {
+    if (wide.empty()) {
+        return;
+    }
+
+    WideRay wideRay(ray);
+
+    struct Entry {
+        uint32_t child, count;
+        float t;
+    };
+    std::array<Entry, MAX_DEPTH * N> stack;
+    int stackSize = 0;
+    stack[stackSize++] = {0, 0, 0};
+
+    while (stackSize > 0) {
+        Entry cur = stack[--stackSize];
+        if (cur.t > best) {
+            continue;
+        }
+        if (cur.count != 0) {
+            leaf(cur.child, cur.count, best);
+            continue;
+        }
+
+        const WideNode<N> &node = wide[cur.child];
+        alignas(32) float dist[N];
+        int mask = intersectChildren(node, wideRay, best, dist);
+
+        // Push hit children sorted by decreasing distance, so the nearest one is popped first.
+        int first = stackSize;
+        for (int i = 0; i < N; i++) {
+            if (!(mask & (1 << i))) {
+                continue;
+            }
+            Entry entry = {node.child[i], node.count[i], dist[i]};
+            int j = stackSize++;
+            while (j > first && stack[j - 1].t < entry.t) {
+                stack[j] = stack[j - 1];
+                j--;
+            }
+            stack[j] = entry;
+        }
+    }
+}
+
+template <int N>
+uint32_t BVH::collapse(uint32_t pos, std::vector<WideNode<N>> &out) const {
+    // Open the largest interior child until the node has N children.
+    std::vector<uint32_t> children = {pos};
+    while (children.size() < N) {
+        int largest = -1;
+        float largestArea = -1;
+        for (size_t i = 0; i < children.size(); i++) {
+            const Node &child = nodes[children[i]];
+            if (!child.isLeaf() && child.aabb().area() > largestArea) {
+                largest = i;
+                largestArea = child.aabb().area();
+            }
+        }
+        if (largest < 0) {
+            break;
+        }
+        uint32_t opened = children[largest];
+        children[largest] = opened + 1;
+        children.push_back(nodes[opened].offset);
+    }
+
+    uint32_t thisPos = out.size();
+    out.emplace_back();
+    for (size_t i = 0; i < children.size(); i++) {
+        const Node &child = nodes[children[i]];
+        WideNode<N> &node = out[thisPos];
+        for (int axis = 0; axis < 3; axis++) {
+            node.bounds[axis][i] = child.min[axis];
+            node.bounds[3 + axis][i] = child.max[axis];
+        }
+        if (child.isLeaf()) {
+            node.child[i] = child.offset;
+            node.count[i] = child.count;
+        } else {
+            uint32_t index = collapse(children[i], out);
+            out[thisPos].child[i] = index;
+        }
+    }
+    return thisPos;
+}
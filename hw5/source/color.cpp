@@ -3,16 +3,16 @@
 #include "color.h"
 
 Color gamma(const Color &x) {
-    float gamma = 1.0 / 2.2;
-    return Color(pow(x.r, gamma), pow(x.g, gamma), pow(x.b, gamma));
+    float gamma = 1.f / 2.2f;
+    return Color(std::pow(x.r, gamma), std::pow(x.g, gamma), std::pow(x.b, gamma));
 }
 
 Color aces(const Color &x) {
-    float a = 2.51;
-    float b = 0.03;
-    float c = 2.43;
-    float d = 0.59;
-    float e = 0.14;
+    float a = 2.51f;
+    float b = 0.03f;
+    float c = 2.43f;
+    float d = 0.59f;
+    float e = 0.14f;
 
     Color res = (x * (a * x + b)) / (x * (c * x + d) + e);
 
@@ -21,3 +21,7 @@ Color aces(const Color &x) {
     float blue = std::min(1.f, std::max(0.f, res.b));
     return {r, g, blue};
 }
+
+float luminance(const Color &x) {
+    return 0.2126f * x.r + 0.7152f * x.g + 0.0722f * x.b;
+}
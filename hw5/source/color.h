@@ -18,6 +18,7 @@ public:
 
 Color gamma(const Color &x);
 Color aces(const Color &x);
+float luminance(const Color &x);
 
 Color operator* (float k, const Color &c);
 
@@ -0,0 +1,117 @@
+#include "denoiser.h"
+#include <algorithm>
+#include <cmath>
+
+static const float KERNEL[5] = {1.f / 16, 1.f / 4, 3.f / 8, 1.f / 4, 1.f / 16};
+static const float GAUSSIAN[3] = {1.f / 4, 1.f / 2, 1.f / 4};
+
+std::vector<Color> Denoiser::denoise(const Film &film) const {
+    int width = film.width, height = film.height;
+    int size = width * height;
+    std::vector<Color> color(size), nextColor(size);
+    std::vector<float> variance(size), nextVariance(size);
+    std::vector<SurfaceAOV> aov(size);
+    std::vector<float> depthGradient(size);
+
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < size; i++) {
+        aov[i] = film.averageAOV(i);
+        // Lights and background seen directly are sharp and exact, so they are
+        // kept out of the filter.
+        color[i] = film.average(i) + -1.f * aov[i].emission;
+        // A single sample says nothing about the noise, so it may be smoothed freely.
+        variance[i] = film.count[i] > 1 ? film.meanVariance(i) : 1e10f;
+        if (aov[i].normal.len_square() > 0) {
+            aov[i].normal = aov[i].normal.normalize();
+        }
+    }
+
+    // Depth change per pixel, so that tilted surfaces are not cut into strips.
+#pragma omp parallel for schedule(static)
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            auto depthAt = [&](int px, int py) {
+                return aov[std::clamp(py, 0, height - 1) * width + std::clamp(px, 0, width - 1)].depth;
+            };
+            float dx = std::fabs(depthAt(x + 1, y) - depthAt(x - 1, y)) / 2;
+            float dy = std::fabs(depthAt(x, y + 1) - depthAt(x, y - 1)) / 2;
+            depthGradient[y * width + x] = std::max(dx, dy);
+        }
+    }
+
+    for (int iteration = 0; iteration < iterations; iteration++) {
+        int step = 1 << iteration;
+
+#pragma omp parallel for schedule(static)
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                int p = y * width + x;
+                const SurfaceAOV &center = aov[p];
+
+                // The luminance weight uses the variance blurred over 3x3 pixels,
+                // which is far less noisy than the pixel's own estimate.
+                float blurredVariance = 0, varianceWeight = 0;
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        int qx = x + dx, qy = y + dy;
+                        if (qx < 0 || qx >= width || qy < 0 || qy >= height) {
+                            continue;
+                        }
+                        float w = GAUSSIAN[dx + 1] * GAUSSIAN[dy + 1];
+                        blurredVariance += w * variance[qy * width + qx];
+                        varianceWeight += w;
+                    }
+                }
+                float luminanceScale = sigmaLuminance * std::sqrt(blurredVariance / varianceWeight) + 1e-6f;
+                float centerLuminance = luminance(color[p]);
+
+                Color sum{0, 0, 0};
+                float sumVariance = 0, sumWeight = 0;
+                for (int dy = -2; dy <= 2; dy++) {
+                    for (int dx = -2; dx <= 2; dx++) {
+                        int qx = x + dx * step, qy = y + dy * step;
+                        if (qx < 0 || qx >= width || qy < 0 || qy >= height) {
+                            continue;
+                        }
+                        int q = qy * width + qx;
+                        const SurfaceAOV &other = aov[q];
+
+                        float w = KERNEL[dx + 2] * KERNEL[dy + 2];
+                        if (q != p) {
+                            bool centerHit = center.normal.len_square() > 0, otherHit = other.normal.len_square() > 0;
+                            if (centerHit != otherHit) {
+                                continue;
+                            }
+                            if (centerHit) {
+                                w *= std::pow(std::max(0.f, center.normal * other.normal), sigmaNormal);
+                            }
+
+                            float depthScale = sigmaDepth * depthGradient[p] * step * std::sqrt(float(dx * dx + dy * dy)) +
+                                               1e-3f * center.depth + 1e-6f;
+                            float albedoDistance = (center.albedo.r - other.albedo.r) * (center.albedo.r - other.albedo.r) +
+                                                   (center.albedo.g - other.albedo.g) * (center.albedo.g - other.albedo.g) +
+                                                   (center.albedo.b - other.albedo.b) * (center.albedo.b - other.albedo.b);
+                            w *= std::exp(-std::fabs(center.depth - other.depth) / depthScale -
+                                          std::fabs(centerLuminance - luminance(color[q])) / luminanceScale -
+                                          albedoDistance / (sigmaAlbedo * sigmaAlbedo));
+                        }
+
+                        sum = sum + w * color[q];
+                        sumVariance += w * w * variance[q];
+                        sumWeight += w;
+                    }
+                }
+
+                nextColor[p] = (1.f / sumWeight) * sum;
+                nextVariance[p] = sumVariance / (sumWeight * sumWeight);
+            }
+        }
+        std::swap(color, nextColor);
+        std::swap(variance, nextVariance);
+    }
+
+    for (int i = 0; i < size; i++) {
+        color[i] = color[i] + aov[i].emission;
+    }
+    return color;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <vector>
+#include "color.h"
+#include "film.h"
+
+// Edge-avoiding A-Trous wavelet filter (Dammertz et al. 2010). Every pass blurs
+// with a 5x5 B3-spline kernel whose taps are spread twice as far apart as in the
+// previous pass, and weights each tap by how similar its normal, depth and albedo
+// are. The luminance weight is scaled by the standard error of the pixel mean
+// kept by the film, as in SVGF (Schied et al. 2017), so converged pixels barely
+// change while noisy ones are smoothed within their surface.
+class Denoiser {
+public:
+    int iterations = 2;
+    float sigmaLuminance = 4;
+    float sigmaNormal = 128;
+    float sigmaDepth = 1;
+    float sigmaAlbedo = 0.1;
+
+    Denoiser() = default;
+
+    // Returns the filtered average colors of the film, before tone mapping.
+    std::vector<Color> denoise(const Film &film) const;
+};
@@ -1,190 +1,387 @@
 #include "distribution.h"
+#include "color.h"
+#include <algorithm>
+
+// Maps the unit square onto the unit sphere, preserving area.
+static Point uniformSphere(std::pair<float, float> u) {
+    float z = 1 - 2 * u.first;
+    float r = std::sqrt(std::max(0.f, 1 - z * z));
+    float phi = 2 * PI * u.second;
+    return {r * std::cos(phi), r * std::sin(phi), z};
+}
 
-Point Uniform::sample(std::normal_distribution<float> &n01, rng_type &rng, Point x, Point n) const {
-    Point d = Point {n01(rng), n01(rng), n01(rng)}.normalize();
-    if (d * n < 0) {
-        d = -1.0 * d;
-    }
-    return d;
+static const Point UNIT[3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+
+// Two unit vectors completing the unit vector n to an orthonormal basis
+// (Duff et al. 2017).
+static std::pair<Point, Point> orthonormalBasis(const Point &n) {
+    float sign = std::copysign(1.f, n.z);
+    float a = -1 / (sign + n.z);
+    float b = n.x * n.y * a;
+    return {Point(1 + sign * n.x * n.x * a, sign * b, -sign * n.x), Point(b, sign + n.y * n.y * a, -n.y)};
 }
 
-float Uniform::pdf(Point x, Point n, Point d) const {
-    if (d * n < 0) {
-        return 0;
+// 1 - cos of the half-angle of the cone of directions towards the unit sphere
+// from a point at the given squared distance from its center.
+static float oneMinusCosThetaMax(float distanceSquared) {
+    float sinSquared = 1 / distanceSquared;
+    if (sinSquared < 1e-3) {
+        // Avoids cancellation for far spheres.
+        return sinSquared / 2 + sinSquared * sinSquared / 8;
     }
-    return 1.0 / (2.0 * PI);
+    return 1 - std::sqrt(1 - sinSquared);
 }
 
-Point Cosine::sample(std::normal_distribution<float> &n01, rng_type &rng, Point x, Point n) const {
-    Point d = Point {n01(rng), n01(rng), n01(rng)}.normalize();
-    d = d + n;
-    float len = sqrt(d.len_square());
+Point Cosine::sample(Sampler &sampler, Point x, Point n) const {
+    Point d = uniformSphere(sampler.get2D()) + n;
+    float len = std::sqrt(d.len_square());
     if (len <= 1e-4 || d * n <= 1e-4 || std::isnan(len)) {
         return n;
     }
-    return 1.0 / len * d;
+    return (1 / len) * d;
 }
 
 float Cosine::pdf(Point x, Point n, Point d) const {
-    return std::max(0.f, float(d * n / PI));
+    return std::max(0.f, d * n / PI);
 }
 
 
-float BoxLight::pdfOne(Point x, Point d, Point y, Point yn) const {
-    return (x - y).len_square() / (sTotal * fabs(d * yn));
-}
-
-Point BoxLight::sample(std::uniform_real_distribution<float> &u01, rng_type &rng, Point x, Point n) const {
-    for (int _ = 0; _ < 1000; _++) {
-        float u = u01(rng) * (wx + wy + wz);
-        float flipSign = u01(rng) > 0.5 ? 1 : -1;
-        Point point;
-
-        if (u < wx) {
-            point = Point(flipSign * sx, (2 * u01(rng) - 1) * sy, (2 * u01(rng) - 1) * sz);
-        } else if (u < wx + wy) {
-            point = Point((2 * u01(rng) - 1) * sx, flipSign * sy, (2 * u01(rng) - 1) * sz);
+// Unnormalized probabilities of picking each face (+x, -x, +y, -y, +z, -z) from
+// the point x given in the box frame: the solid angle the face would subtend if
+// it were small, for the faces x sees. From inside every face is visible and
+// they are picked by area.
+float BoxLight::faceWeights(const Point &x, float weights[6]) const {
+    const Point &s = figure.data;
+    bool inside = std::fabs(x.x) < s.x && std::fabs(x.y) < s.y && std::fabs(x.z) < s.z;
+
+    float total = 0;
+    for (int face = 0; face < 6; face++) {
+        int axis = face / 2;
+        float sign = face % 2 == 0 ? 1 : -1;
+        float area = 4 * s[(axis + 1) % 3] * s[(axis + 2) % 3];
+        float height = sign * x[axis] - s[axis];
+
+        if (inside) {
+            weights[face] = area;
+        } else if (height <= 0) {
+            weights[face] = 0;
         } else {
-            point = Point((2 * u01(rng) - 1) * sx, (2 * u01(rng) - 1) * sy, flipSign * sz);
-        }
-
-        Point actualPoint = figure.rotation.doth().transform(point) + figure.position;
-        if (figure.intersect(Ray(x, (actualPoint - x).normalize())).has_value()) {
-            return (actualPoint - x).normalize();
+            Point center = sign * s[axis] * UNIT[axis];
+            float distanceSquared = (x - center).len_square();
+            weights[face] = area * height / (distanceSquared * std::sqrt(distanceSquared));
         }
+        total += weights[face];
     }
-    return x.normalize();
+    return total;
 }
 
+// The first hit along d is on the face that was sampled to produce d.
+float BoxLight::pdfOne(Point x, Point d, const Intersection &hit) const {
+    auto [t, yn, _] = hit;
+    Point y = x + t * d;
 
-float TriangleLight::pdfOne(Point x, Point d, Point y, Point yn) const {
-    return pointProb * (x - y).len_square() / fabs(d * yn);
-}
+    const Point &s = figure.data;
+    Point local = figure.toLocal.transform(y - figure.position);
+    int axis = 0;
+    for (int i = 1; i < 3; i++) {
+        if (std::fabs(local[i]) / s[i] > std::fabs(local[axis]) / s[axis]) {
+            axis = i;
+        }
+    }
+    int face = 2 * axis + (local[axis] > 0 ? 0 : 1);
 
-Point TriangleLight::sample(std::uniform_real_distribution<float> &u01, rng_type &rng, Point x, Point n) const {
-    const Point &a = figure.data3;
-    const Point &b = figure.data - a;
-    const Point &c = figure.data2 - a;
-    float u = u01(rng);
-    float v = u01(rng);
-    if (u + v > 1.) {
-        u = 1 - u;
-        v = 1 - v;
+    float weights[6];
+    float total = faceWeights(figure.toLocal.transform(x - figure.position), weights);
+    if (weights[face] == 0) {
+        return 0;
     }
-    Point point = figure.position + figure.rotation.doth().transform(a + u * b + v * c);
-    return (point - x).normalize();
+    float area = 4 * s[(axis + 1) % 3] * s[(axis + 2) % 3];
+    return weights[face] / (total * area) * (x - y).len_square() / std::fabs(d * yn);
 }
 
-
-float EllipsoidLight::pdfOne(Point x, Point d, Point y, Point yn) const {
-    Point r = figure.data;
-    auto transf = figure.rotation.transform(y - figure.position);
-    Point n = Point(transf.x / r.x, transf.y / r.y, transf.z / r.z);
-    float pointProb = 1. / (4 * PI * sqrt(Point{n.x * r.y * r.z, r.x * n.y * r.z, r.x * r.y * n.z}.len_square()));
-    return pointProb * (x - y).len_square() / fabs(d * yn);
+LightBounds BoxLight::bounds(const Color &emission) const {
+    LightBounds result;
+    result.bounds = AABB(figure);
+    result.power = luminance(emission) * sTotal;
+    result.cosThetaO = -1;
+    result.cosThetaE = 0;
+    return result;
 }
 
-Point EllipsoidLight::sample(std::normal_distribution<float> &n01, rng_type &rng, Point x, Point n) const {
-    Point r = figure.data;
-
-    for (int i = 0; i < 1000; i++) {
-        auto norm = Point{n01(rng), n01(rng), n01(rng)}.normalize();
-        Point point = r ^ norm;
-        Point actualPoint = figure.rotation.doth().transform(point) + figure.position;
-        if (figure.intersect(Ray(x, (actualPoint - x).normalize())).has_value()) {
-            return (actualPoint - x).normalize();
+// Picks a face x can see and a uniform point on it. The box is convex, so that
+// point is the first one on the box the direction towards it hits.
+std::optional<LightDirection> BoxLight::sample(Sampler &sampler, Point x) const {
+    float weights[6];
+    float total = faceWeights(figure.toLocal.transform(x - figure.position), weights);
+    float u = sampler.get1D() * total;
+    int face = 0;
+    for (int i = 0; i < 6; i++) {
+        if (weights[i] > 0) {
+            face = i;
+            if (u < weights[i]) {
+                break;
+            }
+            u -= weights[i];
         }
     }
-    return x.normalize();
-}
 
-Point
-FiguresMix::sample(std::uniform_real_distribution<float> &u01, std::normal_distribution<float> &n01, rng_type &rng,
-                   Point x, Point n) const {
+    const Point &s = figure.data;
+    int axis = face / 2;
+    float sign = face % 2 == 0 ? 1 : -1;
+    auto [u1, u2] = sampler.get2D();
+    Point point = sign * s[axis] * UNIT[axis] + (2 * u1 - 1) * s[(axis + 1) % 3] * UNIT[(axis + 1) % 3] +
+                  (2 * u2 - 1) * s[(axis + 2) % 3] * UNIT[(axis + 2) % 3];
 
-    int distNum = u01(rng) * figures_.size();
-    if (std::holds_alternative<BoxLight>(figures_[distNum])) {
-        return std::get<BoxLight>(figures_[distNum]).sample(u01, rng, x, n);
-    } else if (std::holds_alternative<EllipsoidLight>(figures_[distNum])) {
-        return std::get<EllipsoidLight>(figures_[distNum]).sample(n01, rng, x, n);
-    } else {
-        return std::get<TriangleLight>(figures_[distNum]).sample(u01, rng, x, n);
+    Point actualPoint = figure.toLocal.transformTransposed(point) + figure.position;
+    if (weights[face] == 0) {
+        return {};
     }
+    Point d = (actualPoint - x).normalize();
+    float distanceSquared = (actualPoint - x).len_square();
+    Point yn = figure.toLocal.transformTransposed(sign * UNIT[axis]);
+    float area = 4 * s[(axis + 1) % 3] * s[(axis + 2) % 3];
+    float pdf = weights[face] / (total * area) * distanceSquared / std::fabs(d * yn);
+    return {LightDirection {d, std::sqrt(distanceSquared), pdf}};
 }
 
-float FiguresMix::pdf(Point x, Point n, Point d) const {
-    return getTotalPdf(0, x, n, d) / figures_.size();
+
+// Angle between unit vectors, accurate for nearly (anti)parallel ones.
+static float angleBetween(const Point &a, const Point &b) {
+    if (a * b < 0) {
+        return PI - 2 * std::asin(std::min(1.f, std::sqrt((a + b).len_square()) / 2));
+    }
+    return 2 * std::asin(std::min(1.f, std::sqrt((b - a).len_square()) / 2));
 }
 
-bool FiguresMix::isEmpty() const {
-    return figures_.empty();
+// The part of v orthogonal to the unit vector w, normalized.
+static Point orthogonalPart(const Point &v, const Point &w) {
+    return (v - (v * w) * w).normalize();
 }
 
-float
-FiguresMix::pdfLight(const std::variant<BoxLight, EllipsoidLight, TriangleLight> &figureLight, Point x, Point n,
-                              Point d) const {
+// Solid angle of the triangle seen from x (Van Oosterom and Strackee 1983).
+float TriangleLight::solidAngle(const Point &x) const {
+    Point a = (vertices[0] - x).normalize();
+    Point b = (vertices[1] - x).normalize();
+    Point c = (vertices[2] - x).normalize();
+    return std::fabs(2 * std::atan2(a * c.inter(b), 1 + a * b + a * c + b * c));
+}
 
-    const Figure &figure = std::visit([](const auto& light) { return light.figure; }, figureLight);
+bool TriangleLight::useSpherical(float solidAngle) const {
+    return spherical && solidAngle >= MIN_SPHERICAL_SOLID_ANGLE && solidAngle <= MAX_SPHERICAL_SOLID_ANGLE;
+}
 
-    auto firstIntersection = figure.intersect(Ray(x, d));
-    if (!firstIntersection.has_value()) {
-        return 0.;
+float TriangleLight::pdfOne(Point x, Point d, const Intersection &hit) const {
+    if (spherical) {
+        float area = solidAngle(x);
+        if (useSpherical(area)) {
+            return 1 / area;
+        }
     }
-    auto [t, yn, _] = firstIntersection.value();
-
+    auto [t, yn, _] = hit;
     Point y = x + t * d;
-    float ans = std::visit([&](const auto& light) { return light.pdfOne(x, d, y, yn); }, figureLight);
+    return pointProb * (x - y).len_square() / std::fabs(d * yn);
+}
+
+// Triangles emit from both faces.
+LightBounds TriangleLight::bounds(const Color &emission) const {
+    LightBounds result;
+    result.bounds = AABB(figure);
+    result.power = luminance(emission) / pointProb;
+    result.axis = figure.toLocal.transformTransposed(figure.normal).normalize();
+    result.cosThetaO = 1;
+    result.cosThetaE = 0;
+    result.twoSided = true;
+    return result;
+}
 
-    if (figure.type == FigureType::TRIANGLE) {
-        return ans;
+// Arvo's method: u.first picks the area of the sub-triangle a b c' with c' on
+// the arc from a to c, and u.second a point on the arc from b to c'.
+std::optional<LightDirection> TriangleLight::sample(Sampler &sampler, Point x) const {
+    float area = spherical ? solidAngle(x) : 0;
+    if (spherical && useSpherical(area)) {
+        auto [u1, u2] = sampler.get2D();
+        Point a = (vertices[0] - x).normalize();
+        Point b = (vertices[1] - x).normalize();
+        Point c = (vertices[2] - x).normalize();
+        // Normals of the planes through the sides (b.inter(a) is a x b).
+        Point nab = b.inter(a).normalize();
+        Point nbc = c.inter(b).normalize();
+        Point nca = a.inter(c).normalize();
+
+        float alpha = angleBetween(nab, -1.f * nca);
+        float beta = angleBetween(nbc, -1.f * nab);
+        float gamma = angleBetween(nca, -1.f * nbc);
+
+        float areaPi = u1 * (alpha + beta + gamma - PI) + PI;
+        float sinAlpha = std::sin(alpha), cosAlpha = std::cos(alpha);
+        float sinPhi = std::sin(areaPi) * cosAlpha - std::cos(areaPi) * sinAlpha;
+        float cosPhi = std::cos(areaPi) * cosAlpha + std::sin(areaPi) * sinAlpha;
+        float k1 = cosPhi + cosAlpha;
+        float k2 = sinPhi - sinAlpha * (a * b);
+        float cosB = (k2 + (k2 * cosPhi - k1 * sinPhi) * cosAlpha) / ((k2 * sinPhi + k1 * cosPhi) * sinAlpha);
+        cosB = std::clamp(cosB, -1.f, 1.f);
+        float sinB = std::sqrt(std::max(0.f, 1 - cosB * cosB));
+        Point cp = cosB * a + sinB * orthogonalPart(c, a);
+
+        float cosTheta = 1 - u2 * (1 - cp * b);
+        float sinTheta = std::sqrt(std::max(0.f, 1 - cosTheta * cosTheta));
+        Point w = cosTheta * b + sinTheta * orthogonalPart(cp, b);
+        if (!std::isnan(w.x) && !std::isnan(w.y) && !std::isnan(w.z)) {
+            w = w.normalize();
+        } else {
+            w = (1.f / 3 * (vertices[0] + vertices[1] + vertices[2]) - x).normalize();
+        }
+        auto hit = figure.intersect(Ray(x, w), false);
+        if (!hit.has_value()) {
+            return {};
+        }
+        return {LightDirection {w, hit.value().t, 1 / area}};
     }
 
-    auto secondIntersection = figure.intersect(Ray(x + (t + 1e-4) * d, d));
-    if (!secondIntersection.has_value()) {
-        return ans;
+    const Point &a = figure.data3;
+    const Point &b = figure.edge1;
+    const Point &c = figure.edge2;
+    auto [u, v] = sampler.get2D();
+    if (u + v > 1) {
+        u = 1 - u;
+        v = 1 - v;
     }
-    auto [t2, yn2, __] = secondIntersection.value();
-    Point y2 = x + (t + 1e-4 + t2) * d;
-    return ans + std::visit([&](const auto& light) { return light.pdfOne(x, d, y2, yn2); }, figureLight);
+    Point point = figure.position + figure.toLocal.transformTransposed(a + u * b + v * c);
+    Point d = (point - x).normalize();
+    float distanceSquared = (point - x).len_square();
+    Point yn = figure.toLocal.transformTransposed(figure.normal).normalize();
+    return {LightDirection {d, std::sqrt(distanceSquared), pointProb * distanceSquared / std::fabs(d * yn)}};
 }
 
-float FiguresMix::getTotalPdf(uint32_t pos, const Point &x, const Point &n, const Point &d) const {
-    Ray ray(x, d);
-    const Node &cur = bvh.nodes[pos];
-    auto intersection = cur.aabb.intersect(ray);
-    if (!intersection.has_value()) {
-        return 0;
-    }
 
-    if (cur.left == 0) {
-        float result = 0;
-        for (uint32_t i = cur.first; i < cur.last; i++) {
-            result += pdfLight(figures_[i], x, n, d);
+// Both the sampling and the pdf work in the frame where the ellipsoid is the
+// unit sphere. There the directions towards it form a cone, sampled uniformly
+// (or the whole sphere of directions from inside). The world direction is
+// A w / |A w| for A = toLocal^T * diag(r), whose Jacobian is |det A| / |A w|^3.
+float EllipsoidLight::pdf(Point x, Point d) const {
+    Point r = figure.data;
+    Point local = figure.toLocal.transform(x - figure.position);
+    Point c = Point(local.x / r.x, local.y / r.y, local.z / r.z);
+    Point dLocal = figure.toLocal.transform(d.normalize());
+    Point w = Point(dLocal.x / r.x, dLocal.y / r.y, dLocal.z / r.z);
+    float len = std::sqrt(w.len_square());
+    w = 1 / len * w;
+
+    float distanceSquared = c.len_square();
+    float pdf;
+    if (distanceSquared <= 1) {
+        pdf = 1 / (4 * PI);
+    } else {
+        float b = c * w;
+        if (b >= 0 || b * b < distanceSquared - 1) {
+            return 0;
         }
-        return result;
+        pdf = 1 / (2 * PI * oneMinusCosThetaMax(distanceSquared));
     }
+    return pdf / (r.x * r.y * r.z * len * len * len);
+}
 
-    return getTotalPdf(cur.left, x, n, d) + getTotalPdf(cur.right, x, n, d);
+float EllipsoidLight::pdfOne(Point x, Point d, const Intersection &) const {
+    return pdf(x, d);
 }
 
-Point
-Mix::sample(std::uniform_real_distribution<float> &u01, std::normal_distribution<float> &n01, rng_type &rng, Point x,
-            Point n) const {
+// Uses Thomsen's approximation of the surface area of an ellipsoid.
+LightBounds EllipsoidLight::bounds(const Color &emission) const {
+    const float p = 1.6075f;
+    Point r = figure.data;
+    float ab = std::pow(r.x * r.y, p), ac = std::pow(r.x * r.z, p), bc = std::pow(r.y * r.z, p);
+
+    LightBounds result;
+    result.bounds = AABB(figure);
+    result.power = luminance(emission) * 4 * PI * std::pow((ab + ac + bc) / 3, 1 / p);
+    result.cosThetaO = -1;
+    result.cosThetaE = 0;
+    return result;
+}
 
-    int distNum = u01(rng) * components.size();
-    if (std::holds_alternative<Cosine>(components[distNum])) {
-        return std::get<Cosine>(components[distNum]).sample(n01, rng, x, n);
+std::optional<LightDirection> EllipsoidLight::sample(Sampler &sampler, Point x) const {
+    Point r = figure.data;
+    Point local = figure.toLocal.transform(x - figure.position);
+    Point c = Point(local.x / r.x, local.y / r.y, local.z / r.z);
+
+    float distanceSquared = c.len_square();
+    auto u = sampler.get2D();
+    Point w;
+    if (distanceSquared <= 1) {
+        w = uniformSphere(u);
     } else {
-        return std::get<FiguresMix>(components[distNum]).sample(u01, n01, rng, x, n);
+        float cosTheta = 1 - u.first * oneMinusCosThetaMax(distanceSquared);
+        float sinTheta = std::sqrt(std::max(0.f, 1 - cosTheta * cosTheta));
+        float phi = 2 * PI * u.second;
+        Point axis = -1 / std::sqrt(distanceSquared) * c;
+        auto [t1, t2] = orthonormalBasis(axis);
+        w = sinTheta * std::cos(phi) * t1 + sinTheta * std::sin(phi) * t2 + cosTheta * axis;
+    }
+    Point d = figure.toLocal.transformTransposed(r ^ w).normalize();
+    auto hit = figure.intersect(Ray(x, d), false);
+    if (!hit.has_value()) {
+        return {};
+    }
+    return {LightDirection {d, hit.value().t, pdf(x, d)}};
+}
+
+FiguresMix::FiguresMix(const std::vector<Figure> &figures, const std::vector<MaterialData> &materials,
+                       bool sphericalTriangles) {
+    lightIndices.assign(figures.size(), -1);
+    std::vector<LightBounds> lightBounds;
+    for (uint32_t i = 0; i < figures.size(); i++) {
+        const Figure &fig = figures[i];
+        const Color &emission = materials[fig.material].emission;
+        if (emission.r == 0 && emission.g == 0 && emission.b == 0) {
+            continue;
+        }
+        if (fig.type != FigureType::BOX && fig.type != FigureType::ELLIPSOID && fig.type != FigureType::TRIANGLE) {
+            continue;
+        }
+        lightIndices[i] = figures_.size();
+        lightFigures.push_back(i);
+        if (fig.type == FigureType::BOX) {
+            figures_.push_back(BoxLight(fig));
+        } else if (fig.type == FigureType::ELLIPSOID) {
+            figures_.push_back(EllipsoidLight(fig));
+        } else {
+            figures_.push_back(TriangleLight(fig, sphericalTriangles));
+        }
+        lightBounds.push_back(std::visit([&](const auto &l) { return l.bounds(emission); }, figures_.back()));
     }
+    lightBvh = LightBVH(lightBounds);
 }
 
-float Mix::pdf(Point x, Point n, Point d) const {
-    float ans = 0;
-    for (const auto &component : components) {
-        std::visit([&](auto&& comp) {
-            ans +=  comp.pdf(x, n, d);
-        }, component);
+std::optional<LightSample> FiguresMix::sampleLight(Sampler &sampler, Point x, Point n) const {
+    float pmf;
+    int light = lightBvh.sample(x, n, sampler.get1D(), pmf);
+    if (light < 0) {
+        return {};
+    }
+    auto sample = std::visit([&](const auto &l) { return l.sample(sampler, x); }, figures_[light]);
+    if (!sample.has_value()) {
+        return {};
     }
-    return ans / float(components.size());
+    auto [direction, distance, pdf] = sample.value();
+    return {LightSample {direction, distance, pdf, uint32_t(light), pmf}};
+}
+
+int FiguresMix::lightOf(uint32_t figure) const {
+    return figure < lightIndices.size() ? lightIndices[figure] : -1;
+}
+
+uint32_t FiguresMix::figureOf(uint32_t light) const {
+    return lightFigures[light];
+}
+
+float FiguresMix::pdfHit(uint32_t light, Point x, Point d, const Intersection &hit) const {
+    return std::visit([&](const auto &l) { return l.pdfOne(x, d, hit); }, figures_[light]);
+}
+
+float FiguresMix::pmf(uint32_t light, Point x, Point n) const {
+    return lightBvh.pmf(x, n, light);
+}
+
+bool FiguresMix::isEmpty() const {
+    return figures_.empty();
 }
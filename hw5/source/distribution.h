@@ -1,130 +1,134 @@
 #pragma once
-#include <random>
 #include <cmath>
-#include <memory>
+#include <optional>
 #include <variant>
+#include <vector>
 #include "point.h"
 #include "figure.h"
-#include "bvh.h"
-
-typedef std::minstd_rand rng_type;
-const float PI = acos(-1);
-
-class Uniform {
-public:
-    Uniform() = default;
-
-    Point sample(std::normal_distribution<float> &n01, rng_type &rng, Point x, Point n) const;
-
-    float pdf(Point x, Point n, Point d) const;
-};
+#include "lightbvh.h"
+#include "sampler.h"
 
+const float PI = std::acos(-1.f);
 
 class Cosine {
 public:
     Cosine() {}
 
-    Point sample(std::normal_distribution<float> &n01, rng_type &rng, Point x, Point n) const;
+    Point sample(Sampler &sampler, Point x, Point n) const;
 
     float pdf(Point x, Point n, Point d) const;
 };
 
+// A direction sampled towards a light from a point, the distance along it to
+// the sampled point of the light and the solid-angle pdf of the direction.
+struct LightDirection {
+    Point direction;
+    float distance;
+    float pdf;
+};
+
 class BoxLight {
 public:
-    float sTotal, sx, sy, sz, wx, wy, wz;
+    float sTotal;
     const Figure figure;
 
-    float pdfOne(Point x, Point d, Point y, Point yn) const;
+    float pdfOne(Point x, Point d, const Intersection &hit) const;
 
     BoxLight(const Figure &box): figure(box) {
-        sx = box.data.x;
-        sy = box.data.y;
-        sz = box.data.z;
+        float sx = box.data.x, sy = box.data.y, sz = box.data.z;
         sTotal = 8 * (sy * sz + sx * sz + sx * sy);
-        wx = sy * sz;
-        wy = sx * sz;
-        wz = sx * sy;
     }
 
-    Point sample(std::uniform_real_distribution<float> &u01, rng_type &rng, Point x, Point n) const;
+    // Empty if the sample cannot reach the light.
+    std::optional<LightDirection> sample(Sampler &sampler, Point x) const;
+    LightBounds bounds(const Color &emission) const;
+
+private:
+    float faceWeights(const Point &x, float weights[6]) const;
 };
 
+// Samples the spherical triangle the light subtends at the shading point if
+// spherical is set, and a uniform point of its area otherwise. Triangles that
+// look too small or too large for the spherical sampler to be accurate are
+// always sampled by area.
 class TriangleLight {
 public:
+    static constexpr float MIN_SPHERICAL_SOLID_ANGLE = 3e-4;
+    static constexpr float MAX_SPHERICAL_SOLID_ANGLE = 6.22f;
+
     float pointProb;
+    bool spherical;
     const Figure figure;
+    Point vertices[3];
 
-    float pdfOne(Point x, Point d, Point y, Point yn) const;
+    float pdfOne(Point x, Point d, const Intersection &hit) const;
 
-    TriangleLight(const Figure &ellipsoid): figure(ellipsoid) {
-        const Point &a = figure.data3;
-        const Point &b = figure.data - a;
-        const Point &c = figure.data2 - a;
-        Point n = b.inter(c);
-        pointProb = 1.0 / (0.5 * sqrt(n.len_square()));
+    TriangleLight(const Figure &triangle, bool spherical = true): spherical(spherical), figure(triangle) {
+        Point n = figure.edge1.inter(figure.edge2);
+        pointProb = 1 / (0.5f * std::sqrt(n.len_square()));
+        vertices[0] = figure.position + figure.toLocal.transformTransposed(figure.data);
+        vertices[1] = figure.position + figure.toLocal.transformTransposed(figure.data3 + figure.edge2);
+        vertices[2] = figure.position + figure.toLocal.transformTransposed(figure.data3);
     }
 
-    Point sample(std::uniform_real_distribution<float> &u01, rng_type &rng, Point x, Point n) const;
+    // Empty if the sample cannot reach the light.
+    std::optional<LightDirection> sample(Sampler &sampler, Point x) const;
+    LightBounds bounds(const Color &emission) const;
+
+private:
+    float solidAngle(const Point &x) const;
+    bool useSpherical(float solidAngle) const;
 };
 
 class EllipsoidLight {
 public:
     const Figure figure;
 
-    float pdfOne(Point x, Point d, Point y, Point yn) const;
+    float pdfOne(Point x, Point d, const Intersection &hit) const;
 
     EllipsoidLight(const Figure &ellipsoid): figure(ellipsoid) {}
 
-    Point sample(std::normal_distribution<float> &n01, rng_type &rng, Point x, Point n) const;
+    // Empty if the sample cannot reach the light.
+    std::optional<LightDirection> sample(Sampler &sampler, Point x) const;
+    LightBounds bounds(const Color &emission) const;
+
+private:
+    float pdf(Point x, Point d) const;
+};
+
+// A direction towards one light with its distance and pdf, and the
+// probability of having picked the light.
+struct LightSample {
+    Point direction;
+    float distance;
+    float pdf;
+    uint32_t light;
+    float pmf;
 };
 
 class FiguresMix {
 public:
     std::vector<std::variant<BoxLight, EllipsoidLight, TriangleLight>> figures_;
-    BVH bvh;
-
-    FiguresMix(std::vector<Figure> figures) {
-        size_t n = std::partition(figures.begin(), figures.end(), [](const auto &fig) {
-            if (fig.emission.r == 0 && fig.emission.g == 0 && fig.emission.b == 0) {
-                return false;
-            }
-            return fig.type == FigureType::BOX || fig.type == FigureType::ELLIPSOID || fig.type == FigureType::TRIANGLE;
-        }) - figures.begin();
-
-        bvh = BVH(figures, n);
-        for (size_t i = 0; i < n; i++) {
-            if (figures[i].type == FigureType::BOX) {
-                figures_.push_back(BoxLight(figures[i]));
-            } else if (figures[i].type == FigureType::ELLIPSOID) {
-                figures_.push_back(EllipsoidLight(figures[i]));
-            } else {
-                figures_.push_back(TriangleLight(figures[i]));
-            }
-        }
-    }
+    // Picks the light to sample.
+    LightBVH lightBvh;
+    // For every figure of the scene, the index of its light or -1.
+    std::vector<int> lightIndices;
+    // The figure of every light.
+    std::vector<uint32_t> lightFigures;
 
-    Point sample(std::uniform_real_distribution<float> &u01, std::normal_distribution<float> &n01, rng_type &rng,
-                 Point x, Point n) const;
-
-    float pdf(Point x, Point n, Point d) const;
+    FiguresMix() = default;
+    FiguresMix(const std::vector<Figure> &figures, const std::vector<MaterialData> &materials,
+               bool sphericalTriangles = true);
 
     bool isEmpty() const;
 
-    float pdfLight(const std::variant<BoxLight, EllipsoidLight, TriangleLight> &figureLight,
-                            Point x, Point n, Point d) const;
-
-    float getTotalPdf(uint32_t pos, const Point &x, const Point &n, const Point &d) const;
+    // Picks a light and samples a point on it. Empty if no light can reach x.
+    std::optional<LightSample> sampleLight(Sampler &sampler, Point x, Point n) const;
+    int lightOf(uint32_t figure) const;
+    uint32_t figureOf(uint32_t light) const;
+    // Solid-angle pdf of sampling d towards the light, where hit is the first
+    // intersection of the light with the ray (x, d). Used when a path finds a
+    // light by itself; a light sample carries its pdf.
+    float pdfHit(uint32_t light, Point x, Point d, const Intersection &hit) const;
+    float pmf(uint32_t light, Point x, Point n) const;
 };
-
-class Mix {
-public:
-    std::vector<std::variant<Cosine, FiguresMix>> components;
-
-    Mix() {}
-    Mix(const std::vector<std::variant<Cosine, FiguresMix>> &components): components(components) {}
-
-    Point sample(std::uniform_real_distribution<float> &u01, std::normal_distribution<float> &n01, rng_type &rng,
-                 Point x, Point n) const;
-
-    float pdf(Point x, Point n, Point d) const;
-};
\ No newline at end of file
@@ -1,14 +1,37 @@
 #include "figure.h"
 #include <cmath>
+#include <tuple>
+
+bool operator<(const MaterialData &a, const MaterialData &b) {
+    auto key = [](const MaterialData &m) {
+        return std::make_tuple(m.type, m.color.r, m.color.g, m.color.b, m.emission.r, m.emission.g, m.emission.b,
+                               m.ior);
+    };
+    return key(a) < key(b);
+}
 
 Figure::Figure() = default;
 
-Figure::Figure(FigureType type, Point data): type(type), data(data) {};
+Figure::Figure(FigureType type, Point data): type(type), data(data) {}
 
-Figure::Figure(FigureType type, Point data, Point data2, Point data3): type(type), data(data), data2(data2), data3(data3) {};
+void Figure::prepare(const FigureInput &input) {
+    rotated = !input.rotation.isIdentity();
+    toLocal = input.rotation.matrix();
+    if (type == FigureType::ELLIPSOID || type == FigureType::BOX) {
+        inverseData = Point(1 / data.x, 1 / data.y, 1 / data.z);
+    } else if (type == FigureType::TRIANGLE) {
+        edge1 = data - data3;
+        edge2 = input.data2 - data3;
+        normal = edge1.inter(edge2);
+    }
+}
+
+Ray Figure::toLocalRay(const Ray &ray) const {
+    return rotated ? Ray(toLocal.transform(ray.o - position), toLocal.transform(ray.d)) : ray - position;
+}
 
-std::optional<Intersection> Figure::intersect(const Ray &ray) const {
-    Ray transformed = (ray - position).rotate(rotation);
+std::optional<Intersection> Figure::intersect(const Ray &ray, bool require_normal) const {
+    Ray transformed = toLocalRay(ray);
 
     std::optional<Intersection> result;
     if (type == FigureType::ELLIPSOID) {
@@ -21,12 +44,15 @@ std::optional<Intersection> Figure::intersect(const Ray &ray) const {
         result = intersectAsTriangle(transformed);
     }
 
-    if (!result.has_value()) {
-        return {};
+    if (!result.has_value() || !require_normal) {
+        return result;
     }
-    auto [t, norma, is_inside] = result.value();
-    norma = rotation.doth().transform(norma).normalize();
-    return {Intersection {t, norma, is_inside}};
+    return localSurface(transformed, result.value());
+}
+
+bool Figure::occludes(const Ray &ray, float tMax) const {
+    auto intersection = intersect(ray, false);
+    return intersection.has_value() && intersection.value().t < tMax;
 }
 
 std::optional<std::pair<float, bool>> smallestPositiveRootOfQuadraticEquation(float a, float b, float c) {
@@ -35,8 +61,8 @@ std::optional<std::pair<float, bool>> smallestPositiveRootOfQuadraticEquation(fl
         return {};
     }
 
-    float x1 = (-b - sqrt(d)) / (2 * a);
-    float x2 = (-b + sqrt(d)) / (2 * a);
+    float x1 = (-b - std::sqrt(d)) / (2 * a);
+    float x2 = (-b + std::sqrt(d)) / (2 * a);
     if (x1 > x2) {
         std::swap(x1, x2);
     }
@@ -51,11 +77,10 @@ std::optional<std::pair<float, bool>> smallestPositiveRootOfQuadraticEquation(fl
 }
 
 std::optional<Intersection> Figure::intersectAsEllipsoid(const Ray &ray) const {
-    Point r = data;
-    auto ro = Point(ray.o.x / r.x, ray.o.y / r.y, ray.o.z / r.z);
-    auto rd = Point(ray.d.x / r.x, ray.d.y / r.y, ray.d.z / r.z);
+    auto ro = ray.o ^ inverseData;
+    auto rd = ray.d ^ inverseData;
     float c = ro.len_square() - 1;
-    float b = 2.0 * ro * rd;
+    float b = 2.f * (ro * rd);
     float a = rd.len_square();
 
     auto opt_t = smallestPositiveRootOfQuadraticEquation(a, b, c);
@@ -64,19 +89,14 @@ std::optional<Intersection> Figure::intersectAsEllipsoid(const Ray &ray) const {
     }
 
     auto [t, is_inside] = opt_t.value();
-    Point point = ray.o + t * ray.d;
-    Point norma = (1.0 / (r * r)) * point;
-    if (is_inside) {
-        norma = -1. * norma;
-    }
-    return {Intersection {t, norma.normalize(), is_inside}};
+    return {Intersection {t, {}, is_inside}};
 }
 
 std::optional<Intersection> intersectPlaneAndRay(const Point &n, const Ray &ray) {
     float t = -(ray.o * n) / (ray.d * n);
     if (t > 0 && t < 1e4) {
         if (ray.d * n > 0) {
-            return {Intersection {t, -1.0 * n, true}};
+            return {Intersection {t, -1.f * n, true}};
         }
         return {Intersection {t, n, false}};
     }
@@ -87,20 +107,21 @@ std::optional<Intersection> Figure::intersectAsPlane(const Ray &ray) const {
     return intersectPlaneAndRay(data, ray);
 }
 
-std::optional<Intersection> intersectBoxAndRay(const Point& s, const Ray& ray, bool require_normal = true) {
-    auto calculateInterval = [&](float start, float end, float dir) {
-        float t1 = (start) / dir;
-        float t2 = (end) / dir;
+// Box of half sizes s centered at the origin.
+static std::optional<Intersection> intersectBoxAndRay(const Point &s, const Ray &ray) {
+    auto calculateInterval = [&](float start, float end, float invDir) {
+        float t1 = start * invDir;
+        float t2 = end * invDir;
         if (t1 > t2)
             std::swap(t1, t2);
         return std::make_pair(t1, t2);
     };
 
-    auto mi = (-1.0 * s - ray.o);
+    auto mi = (-1.f * s - ray.o);
     auto ma = (s - ray.o);
-    auto tsX = calculateInterval(mi.x, ma.x, ray.d.x);
-    auto tsY = calculateInterval(mi.y, ma.y, ray.d.y);
-    auto tsZ = calculateInterval(mi.z, ma.z, ray.d.z);
+    auto tsX = calculateInterval(mi.x, ma.x, 1 / ray.d.x);
+    auto tsY = calculateInterval(mi.y, ma.y, 1 / ray.d.y);
+    auto tsZ = calculateInterval(mi.z, ma.z, 1 / ray.d.z);
 
     float t1 = std::max(tsX.first, std::max(tsY.first, tsZ.first));
     float t2 = std::min(tsX.second, std::min(tsY.second, tsZ.second));
@@ -119,12 +140,12 @@ std::optional<Intersection> intersectBoxAndRay(const Point& s, const Ray& ray, b
         t = t1;
     }
 
-    if (!require_normal) {
-        return {Intersection {t, {}, is_inside}};
-    }
+    return {Intersection {t, {}, is_inside}};
+}
 
-    Point p = ray.o + t * ray.d;
-    Point normal = Point(p.x / s.x, p.y / s.y, p.z / s.z);
+// The normal of the face of the box of inverse half sizes invS the point p is on.
+static Point boxNormal(const Point &invS, const Point &p, bool is_inside) {
+    Point normal = p ^ invS;
     float maxComponent = std::max(std::fabs(normal.x), std::max(std::fabs(normal.y), std::fabs(normal.z)));
     if (std::fabs(normal.x) != maxComponent)
         normal.x = 0;
@@ -137,7 +158,7 @@ std::optional<Intersection> intersectBoxAndRay(const Point& s, const Ray& ray, b
         normal = -1.0f * normal;
     }
 
-    return {Intersection {t, normal, is_inside}};
+    return normal;
 }
 
 std::optional<Intersection> Figure::intersectAsBox(const Ray &ray) const {
@@ -145,10 +166,42 @@ std::optional<Intersection> Figure::intersectAsBox(const Ray &ray) const {
 }
 
 std::optional<Intersection> Figure::intersectAsTriangle(const Ray &ray) const {
-    const Point &a = data3;
-    const Point &b = data - a;
-    const Point &c = data2 - a;
-    Point n = b.inter(c);
+    return intersectTriangleAndRay(data3, edge1, edge2, normal, ray);
+}
+
+Intersection Figure::computeSurface(const Ray &ray, const Intersection &hit) const {
+    return localSurface(toLocalRay(ray), hit);
+}
+
+Intersection Figure::localSurface(const Ray &ray, const Intersection &hit) const {
+    Point norma;
+    bool is_inside = hit.is_inside;
+    if (type == FigureType::ELLIPSOID) {
+        Point point = ray.o + hit.t * ray.d;
+        norma = point ^ (inverseData ^ inverseData);
+        if (is_inside) {
+            norma = -1.f * norma;
+        }
+    } else if (type == FigureType::BOX) {
+        norma = boxNormal(inverseData, ray.o + hit.t * ray.d, is_inside);
+    } else {
+        // As intersectPlaneAndRay turns the normal towards the ray.
+        norma = type == FigureType::PLANE ? data : normal;
+        is_inside = ray.d * norma > 0;
+        if (is_inside) {
+            norma = -1.f * norma;
+        }
+    }
+
+    if (rotated) {
+        norma = toLocal.transformTransposed(norma);
+    }
+    norma = norma.normalize();
+    return {hit.t, norma, is_inside};
+}
+
+std::optional<Intersection> intersectTriangleAndRay(const Point &a, const Point &b, const Point &c, const Point &n,
+                                                    const Ray &ray) {
     auto intersection = intersectPlaneAndRay(n, ray - a);
     if (!intersection.has_value()) {
         return {};
@@ -169,30 +222,31 @@ std::optional<Intersection> Figure::intersectAsTriangle(const Ray &ray) const {
 
 AABB::AABB(const Figure &fig) {
     if (fig.type == FigureType::BOX || fig.type == FigureType::ELLIPSOID) {
-        min = (-1.) * fig.data;
+        min = -1.f * fig.data;
         max = fig.data;
     } else if (fig.type == FigureType::TRIANGLE) {
+        Point data2 = fig.data3 + fig.edge2;
         min = Point(
-                std::min(fig.data3.x, std::min(fig.data.x, fig.data2.x)),
-                std::min(fig.data3.y, std::min(fig.data.y, fig.data2.y)),
-                std::min(fig.data3.z, std::min(fig.data.z, fig.data2.z))
+                std::min(fig.data3.x, std::min(fig.data.x, data2.x)),
+                std::min(fig.data3.y, std::min(fig.data.y, data2.y)),
+                std::min(fig.data3.z, std::min(fig.data.z, data2.z))
         );
         max = Point(
-                std::max(fig.data3.x, std::max(fig.data.x, fig.data2.x)),
-                std::max(fig.data3.y, std::max(fig.data.y, fig.data2.y)),
-                std::max(fig.data3.z, std::max(fig.data.z, fig.data2.z))
+                std::max(fig.data3.x, std::max(fig.data.x, data2.x)),
+                std::max(fig.data3.y, std::max(fig.data.y, data2.y)),
+                std::max(fig.data3.z, std::max(fig.data.z, data2.z))
         );
     }
-    auto rotation = fig.rotation.doth();
+    const Matrix &rotation = fig.toLocal;
     AABB unbiased = *this;
-    min = max = rotation.transform(unbiased.min);
-    extend(rotation.transform(Point(unbiased.min.x, unbiased.min.y, unbiased.max.z)));
-    extend(rotation.transform(Point(unbiased.min.x, unbiased.max.y, unbiased.min.z)));
-    extend(rotation.transform(Point(unbiased.min.x, unbiased.max.y, unbiased.max.z)));
-    extend(rotation.transform(Point(unbiased.max.x, unbiased.min.y, unbiased.min.z)));
-    extend(rotation.transform(Point(unbiased.max.x, unbiased.min.y, unbiased.max.z)));
-    extend(rotation.transform(Point(unbiased.max.x, unbiased.max.y, unbiased.min.z)));
-    extend(rotation.transform(Point(unbiased.max.x, unbiased.max.y, unbiased.max.z)));
+    min = max = rotation.transformTransposed(unbiased.min);
+    extend(rotation.transformTransposed(Point(unbiased.min.x, unbiased.min.y, unbiased.max.z)));
+    extend(rotation.transformTransposed(Point(unbiased.min.x, unbiased.max.y, unbiased.min.z)));
+    extend(rotation.transformTransposed(Point(unbiased.min.x, unbiased.max.y, unbiased.max.z)));
+    extend(rotation.transformTransposed(Point(unbiased.max.x, unbiased.min.y, unbiased.min.z)));
+    extend(rotation.transformTransposed(Point(unbiased.max.x, unbiased.min.y, unbiased.max.z)));
+    extend(rotation.transformTransposed(Point(unbiased.max.x, unbiased.max.y, unbiased.min.z)));
+    extend(rotation.transformTransposed(Point(unbiased.max.x, unbiased.max.y, unbiased.max.z)));
     min = min + fig.position;
     max = max + fig.position;
 }
@@ -208,8 +262,12 @@ void AABB::extend(const Point &p) {
 }
 
 void AABB::extend(const AABB &aabb) {
-    extend(aabb.min);
-    extend(aabb.max);
+    max.x = std::max(max.x, aabb.max.x);
+    max.y = std::max(max.y, aabb.max.y);
+    max.z = std::max(max.z, aabb.max.z);
+    min.x = std::min(min.x, aabb.min.x);
+    min.y = std::min(min.y, aabb.min.y);
+    min.z = std::min(min.z, aabb.min.z);
 }
 
 float AABB::area() const {
@@ -218,5 +276,6 @@ float AABB::area() const {
 }
 
 std::optional<Intersection> AABB::intersect(const Ray &ray) const {
-    return intersectBoxAndRay(0.5 * (max - min), ray - 0.5 * (min + max), false);
+    Point s = 0.5f * (max - min);
+    return intersectBoxAndRay(s, ray - 0.5f * (min + max));
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 #include <optional>
 #include <cassert>
+#include <cmath>
 #include "point.h"
 #include "color.h"
 #include "rotation.h"
@@ -11,7 +12,7 @@ enum class Material {
 
 class Ray {
 public:
-    const Point o{}, d{};
+    Point o{}, d{};
 
     Ray() = default;
     Ray(Point o, Point d);
@@ -42,40 +43,86 @@ struct Intersection {
 };
 
 enum class FigureType {
-    ELLIPSOID, PLANE, BOX, TRIANGLE
+    ELLIPSOID, PLANE, BOX, TRIANGLE, MESH
 };
 
+// Triangle with vertex a, edges b and c from it and normal n = b.inter(c). The
+// normal of the result faces the ray and is not normalized.
+std::optional<Intersection> intersectTriangleAndRay(const Point &a, const Point &b, const Point &c, const Point &n,
+                                                    const Ray &ray);
+
+// Shading attributes of a figure, kept out of Figure so that intersection
+// tests load geometry only. Figures with equal attributes share one entry of
+// Scene::materials.
+struct MaterialData {
+    Material type = Material::DIFFUSE;
+    Color color{};
+    Color emission{};
+    float ior = 1;
+};
+
+bool operator<(const MaterialData &a, const MaterialData &b);
+
+// Fields of the scene file that only prepare() reads. The parser keeps them
+// aside, so that figures hold nothing the renderer does not use.
+struct FigureInput {
+    Rotation rotation{};
+    // The vertex of a triangle between data and data3.
+    Point data2{};
+};
+
+// Geometry of a figure. The fields intersect() reads come first.
 class Figure {
 private:
+    // These take the ray in the local frame and fill only t and is_inside.
     std::optional<Intersection> intersectAsEllipsoid(const Ray &ray) const;
     std::optional<Intersection> intersectAsPlane(const Ray &ray) const;
     std::optional<Intersection> intersectAsBox(const Ray &ray) const;
     std::optional<Intersection> intersectAsTriangle(const Ray &ray) const;
 
-public:
-    Point position{};
-    Rotation rotation{};
-    Material material = Material::DIFFUSE;
-    Color color{};
-    Color emission{};
-    float ior;
+    Ray toLocalRay(const Ray &ray) const;
+    Intersection localSurface(const Ray &ray, const Intersection &hit) const;
 
+public:
     FigureType type;
+    // Filled by prepare() from its input and the fields below, which must not
+    // change afterwards. The transpose of toLocal brings the local frame back.
+    bool rotated = false;
+    Point position{};
+    Matrix toLocal{};
+    // Inverse radii of an ellipsoid or half sizes of a box.
+    Point inverseData{};
+    // Edges of a triangle from data3 and their normal, in the local frame.
+    // The vertices are data3, data3 + edge1 = data and data3 + edge2.
+    Point edge1{}, edge2{}, normal{};
     Point data{};
-    Point data2{};
     Point data3{};
+    // Index into Scene::meshes for MESH figures.
+    uint32_t mesh = 0;
+    // Index into Scene::materials.
+    uint32_t material = 0;
 
     Figure();
     Figure(FigureType type, Point data);
-    Figure(FigureType type, Point data, Point data2, Point data3);
 
-    std::optional<Intersection> intersect(const Ray &ray) const;
+    // Precomputes the constants used by intersect() once the figure is parsed.
+    void prepare(const FigureInput &input);
+
+    // Without require_normal only t and is_inside of the result are filled.
+    std::optional<Intersection> intersect(const Ray &ray, bool require_normal = true) const;
+    // Completes a hit found by intersect(ray, false) with the normal there.
+    // Planes and triangles find their side from the ray again, so is_inside
+    // of hit is only read for ellipsoids and boxes.
+    Intersection computeSurface(const Ray &ray, const Intersection &hit) const;
+    // Whether the ray hits the figure closer than tMax.
+    bool occludes(const Ray &ray, float tMax) const;
 };
 
 class AABB {
 public:
-    Point min;
-    Point max;
+    // An empty box, so that extending it by anything yields that thing's bounds.
+    Point min = Point(INFINITY, INFINITY, INFINITY);
+    Point max = Point(-INFINITY, -INFINITY, -INFINITY);
 
     AABB() = default;
     AABB(const Figure &fig);
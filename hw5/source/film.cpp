@@ -0,0 +1,131 @@
+#include "film.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const char MAGIC[4] = {'F', 'I', 'L', 'M'};
+static const uint32_t VERSION = 3;
+
+Film::Film(int width, int height): width(width), height(height), sum(width * height, Color(0, 0, 0)),
+                                   count(width * height, 0), mean(width * height, 0), m2(width * height, 0),
+                                   albedo(width * height, Color(0, 0, 0)), emission(width * height, Color(0, 0, 0)),
+                                   normal(width * height, Point(0, 0, 0)),
+                                   depth(width * height, 0) {}
+
+template <typename T>
+static void writeArray(std::ostream &out, const std::vector<T> &values) {
+    out.write(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(T));
+}
+
+template <typename T>
+static bool readArray(std::istream &in, std::vector<T> &values) {
+    return bool(in.read(reinterpret_cast<char *>(values.data()), values.size() * sizeof(T)));
+}
+
+void Film::copyRect(const Film &other, int fromX, int fromY, int x, int y, int w, int h) {
+    for (int row = 0; row < h; row++) {
+        int from = (fromY + row) * other.width + fromX, to = (y + row) * width + x;
+        std::copy_n(other.sum.begin() + from, w, sum.begin() + to);
+        std::copy_n(other.count.begin() + from, w, count.begin() + to);
+        std::copy_n(other.mean.begin() + from, w, mean.begin() + to);
+        std::copy_n(other.m2.begin() + from, w, m2.begin() + to);
+        std::copy_n(other.albedo.begin() + from, w, albedo.begin() + to);
+        std::copy_n(other.emission.begin() + from, w, emission.begin() + to);
+        std::copy_n(other.normal.begin() + from, w, normal.begin() + to);
+        std::copy_n(other.depth.begin() + from, w, depth.begin() + to);
+    }
+}
+
+// Flushes a file or directory to the disk.
+static bool syncPath(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+}
+
+bool Film::save(const std::string &path) const {
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        int32_t size[2] = {width, height};
+        out.write(MAGIC, sizeof(MAGIC));
+        out.write(reinterpret_cast<const char *>(&VERSION), sizeof(VERSION));
+        out.write(reinterpret_cast<const char *>(size), sizeof(size));
+        out.write(reinterpret_cast<const char *>(&fingerprint), sizeof(fingerprint));
+        writeArray(out, sum);
+        writeArray(out, count);
+        writeArray(out, mean);
+        writeArray(out, m2);
+        writeArray(out, albedo);
+        writeArray(out, emission);
+        writeArray(out, normal);
+        writeArray(out, depth);
+        out.flush();
+        if (!out) {
+            std::cerr << "Cannot write checkpoint: " << temporary << std::endl;
+            return false;
+        }
+    }
+    // The data must reach the disk before the rename does, or a crash can
+    // leave the new name pointing at an incomplete file.
+    if (!syncPath(temporary)) {
+        std::cerr << "Cannot sync checkpoint: " << temporary << std::endl;
+        return false;
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::cerr << "Cannot replace checkpoint: " << path << std::endl;
+        return false;
+    }
+    size_t slash = path.rfind('/');
+    syncPath(slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash));
+    return true;
+}
+
+bool Film::load(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+
+    char magic[4];
+    uint32_t version;
+    int32_t size[2];
+    uint64_t saved;
+    in.read(magic, sizeof(magic));
+    in.read(reinterpret_cast<char *>(&version), sizeof(version));
+    in.read(reinterpret_cast<char *>(size), sizeof(size));
+    in.read(reinterpret_cast<char *>(&saved), sizeof(saved));
+    if (!in || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || version != VERSION) {
+        std::cerr << "Not a checkpoint, starting over: " << path << std::endl;
+        return false;
+    }
+    if (size[0] != width || size[1] != height) {
+        std::cerr << "Checkpoint is " << size[0] << "x" << size[1] << ", starting over: " << path << std::endl;
+        return false;
+    }
+    if (saved != fingerprint) {
+        std::cerr << "Checkpoint is of another scene or sampler, starting over: " << path << std::endl;
+        return false;
+    }
+
+    Film loaded(width, height);
+    loaded.fingerprint = fingerprint;
+    if (!readArray(in, loaded.sum) || !readArray(in, loaded.count) || !readArray(in, loaded.mean) ||
+        !readArray(in, loaded.m2) || !readArray(in, loaded.albedo) || !readArray(in, loaded.emission) ||
+        !readArray(in, loaded.normal) ||
+        !readArray(in, loaded.depth)) {
+        std::cerr << "Truncated checkpoint, starting over: " << path << std::endl;
+        return false;
+    }
+    *this = std::move(loaded);
+    return true;
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "color.h"
+#include "point.h"
+
+// What a camera sample saw first: the albedo and normal of the first diffuse
+// surface on its path, the distance to the first hit (0 if it missed) and the
+// emission or background it saw there.
+struct SurfaceAOV {
+    Color albedo{0, 0, 0};
+    Color emission{0, 0, 0};
+    Point normal{0, 0, 0};
+    float depth = 0;
+};
+
+// Per-pixel accumulation state of a render: the sum of the sample colors, the
+// number of samples and Welford accumulators of their luminance, and the sums
+// of the AOVs. It can be saved to a checkpoint file and loaded back to continue
+// the render later.
+class Film {
+public:
+    int width, height;
+    std::vector<Color> sum;
+    std::vector<uint32_t> count;
+    std::vector<float> mean, m2;
+    std::vector<Color> albedo, emission;
+    std::vector<Point> normal;
+    std::vector<float> depth;
+    // Identifies what the samples were taken of; a checkpoint with another
+    // fingerprint is not loaded.
+    uint64_t fingerprint = 0;
+
+    Film(int width, int height);
+
+    void add(int pixel, const Color &color, const SurfaceAOV &aov);
+    Color average(int pixel) const;
+    SurfaceAOV averageAOV(int pixel) const;
+    // Copies the w x h block of other at (fromX, fromY) to (x, y) of this film.
+    void copyRect(const Film &other, int fromX, int fromY, int x, int y, int w, int h);
+    // Squared standard error of the mean luminance of the pixel.
+    float meanVariance(int pixel) const;
+
+    // The file is replaced atomically, so an interrupted save keeps the old one.
+    bool save(const std::string &path) const;
+    // Leaves the film untouched if there is no checkpoint of the same size and
+    // fingerprint at the path.
+    bool load(const std::string &path);
+};
+
+inline void Film::add(int pixel, const Color &color, const SurfaceAOV &aov) {
+    sum[pixel] = sum[pixel] + color;
+    count[pixel]++;
+    albedo[pixel] = albedo[pixel] + aov.albedo;
+    emission[pixel] = emission[pixel] + aov.emission;
+    normal[pixel] = normal[pixel] + aov.normal;
+    depth[pixel] += aov.depth;
+
+    float delta = luminance(color) - mean[pixel];
+    mean[pixel] += delta / count[pixel];
+    m2[pixel] += delta * (luminance(color) - mean[pixel]);
+}
+
+inline Color Film::average(int pixel) const {
+    return (1.f / count[pixel]) * sum[pixel];
+}
+
+inline SurfaceAOV Film::averageAOV(int pixel) const {
+    float k = 1.f / count[pixel];
+    return {k * albedo[pixel], k * emission[pixel], k * normal[pixel], k * depth[pixel]};
+}
+
+inline float Film::meanVariance(int pixel) const {
+    return m2[pixel] / (count[pixel] - 1) / count[pixel];
+}
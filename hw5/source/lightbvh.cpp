@@ -0,0 +1,271 @@
+#include "lightbvh.h"
+#include <algorithm>
+#include <cmath>
+
+static const float PI = std::acos(-1.f);
+
+static float safeSqrt(float x) {
+    return std::sqrt(std::max(0.f, x));
+}
+
+static float safeAcos(float x) {
+    return std::acos(std::clamp(x, -1.f, 1.f));
+}
+
+// cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of a and b.
+static float cosSubClamped(float sinA, float cosA, float sinB, float cosB) {
+    if (cosA > cosB) {
+        return 1;
+    }
+    return cosA * cosB + sinA * sinB;
+}
+
+static float sinSubClamped(float sinA, float cosA, float sinB, float cosB) {
+    if (cosA > cosB) {
+        return 0;
+    }
+    return sinA * cosB - cosA * sinB;
+}
+
+float LightBounds::importance(const Point &p, const Point &n) const {
+    Point center = 0.5f * (bounds.min + bounds.max);
+    Point diagonal = bounds.max - bounds.min;
+    float distanceSquared = std::max((p - center).len_square(), 0.5f * std::sqrt(diagonal.len_square()));
+
+    // Half-angle of the cone of directions from p that hit the bounds.
+    float cosThetaB = -1;
+    float radiusSquared = 0.25f * diagonal.len_square();
+    if ((p - center).len_square() > radiusSquared) {
+        cosThetaB = safeSqrt(1 - radiusSquared / (p - center).len_square());
+    }
+    float sinThetaB = safeSqrt(1 - cosThetaB * cosThetaB);
+
+    Point wi = (p - center).normalize();
+    float cosThetaW = axis * wi;
+    if (twoSided) {
+        cosThetaW = std::abs(cosThetaW);
+    }
+    float sinThetaW = safeSqrt(1 - cosThetaW * cosThetaW);
+    float sinThetaO = safeSqrt(1 - cosThetaO * cosThetaO);
+
+    // Smallest possible angle between an emitting normal and the direction to p.
+    float cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    float sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    float cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+    if (cosThetaP <= cosThetaE) {
+        return 0;
+    }
+
+    // Smallest possible angle between n and a direction towards the lights.
+    float cosThetaI = -1.f * wi * n;
+    float sinThetaI = safeSqrt(1 - cosThetaI * cosThetaI);
+    float cosThetaIP = cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+    if (cosThetaIP <= 0) {
+        return 0;
+    }
+    return power * cosThetaP * cosThetaIP / distanceSquared;
+}
+
+LightBounds unite(const LightBounds &a, const LightBounds &b) {
+    if (a.power == 0) {
+        return b;
+    }
+    if (b.power == 0) {
+        return a;
+    }
+
+    LightBounds result;
+    result.bounds = a.bounds;
+    result.bounds.extend(b.bounds);
+    result.power = a.power + b.power;
+    result.cosThetaE = std::min(a.cosThetaE, b.cosThetaE);
+    result.twoSided = a.twoSided || b.twoSided;
+
+    // The smallest cone around both normal cones.
+    float thetaA = safeAcos(a.cosThetaO), thetaB = safeAcos(b.cosThetaO);
+    float thetaD = safeAcos(a.axis * b.axis);
+    if (std::min(thetaD + thetaB, PI) <= thetaA) {
+        result.axis = a.axis;
+        result.cosThetaO = a.cosThetaO;
+        return result;
+    }
+    if (std::min(thetaD + thetaA, PI) <= thetaB) {
+        result.axis = b.axis;
+        result.cosThetaO = b.cosThetaO;
+        return result;
+    }
+
+    float thetaO = (thetaA + thetaD + thetaB) / 2;
+    Point rotationAxis = b.axis.inter(a.axis);
+    if (thetaO >= PI || rotationAxis.len_square() == 0) {
+        result.cosThetaO = -1;
+        return result;
+    }
+    // Rotate a.axis towards b.axis around their common perpendicular.
+    float thetaR = thetaO - thetaA;
+    Point k = rotationAxis.normalize();
+    result.axis = (std::cos(thetaR) * a.axis + std::sin(thetaR) * a.axis.inter(k)).normalize();
+    result.cosThetaO = std::cos(thetaO);
+    return result;
+}
+
+// Surface area orientation heuristic: the power of the group weighted by the
+// solid angle its emission can reach and by the area of its bounds.
+static float splitCost(const LightBounds &b, const AABB &bounds, int axis) {
+    if (b.power == 0) {
+        return 0;
+    }
+    float thetaO = safeAcos(b.cosThetaO), thetaE = safeAcos(b.cosThetaE);
+    float thetaW = std::min(thetaO + thetaE, PI);
+    float sinThetaO = safeSqrt(1 - b.cosThetaO * b.cosThetaO);
+    float solidAngle = 2 * PI * (1 - b.cosThetaO) +
+                       PI / 2 * (2 * thetaW * sinThetaO - std::cos(thetaO - 2 * thetaW) - 2 * thetaO * sinThetaO +
+                                 b.cosThetaO);
+    Point diagonal = bounds.max - bounds.min;
+    float elongation = std::max(diagonal.x, std::max(diagonal.y, diagonal.z)) / diagonal[axis];
+    return b.power * solidAngle * elongation * b.bounds.area();
+}
+
+LightBVH::LightBVH(const std::vector<LightBounds> &lights) {
+    if (lights.empty()) {
+        return;
+    }
+    trails.resize(lights.size());
+    std::vector<uint32_t> order(lights.size());
+    for (uint32_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    nodes.reserve(2 * lights.size() - 1);
+    buildNode(lights, order, 0, order.size(), 0, 0);
+}
+
+void LightBVH::buildNode(const std::vector<LightBounds> &lights, std::vector<uint32_t> &order, uint32_t first,
+                         uint32_t last, uint64_t trail, int depth) {
+    uint32_t pos = nodes.size();
+    nodes.emplace_back();
+
+    if (last - first == 1) {
+        nodes[pos] = {lights[order[first]], order[first], true};
+        trails[order[first]] = trail;
+        return;
+    }
+
+    LightBounds total;
+    AABB centroids;
+    for (uint32_t i = first; i < last; i++) {
+        const LightBounds &light = lights[order[i]];
+        total = unite(total, light);
+        centroids.extend(0.5f * (light.bounds.min + light.bounds.max));
+    }
+
+    float bestCost = INFINITY;
+    int bestAxis = -1, bestBin = -1;
+    auto binOf = [&](uint32_t light, int axis) {
+        Point centroid = 0.5f * (lights[light].bounds.min + lights[light].bounds.max);
+        float offset = (centroid[axis] - centroids.min[axis]) / (centroids.max[axis] - centroids.min[axis]);
+        return std::min(BINS - 1, int(BINS * offset));
+    };
+
+    // Past half the depth limit only median splits are made, which keeps every
+    // trail within its 64 bits.
+    if (depth < MAX_DEPTH / 2) {
+        for (int axis = 0; axis < 3; axis++) {
+            if (centroids.max[axis] == centroids.min[axis]) {
+                continue;
+            }
+            LightBounds bins[BINS];
+            for (uint32_t i = first; i < last; i++) {
+                int bin = binOf(order[i], axis);
+                bins[bin] = unite(bins[bin], lights[order[i]]);
+            }
+
+            for (int split = 0; split + 1 < BINS; split++) {
+                LightBounds below, above;
+                for (int i = 0; i <= split; i++) {
+                    below = unite(below, bins[i]);
+                }
+                for (int i = split + 1; i < BINS; i++) {
+                    above = unite(above, bins[i]);
+                }
+                float cost = splitCost(below, total.bounds, axis) + splitCost(above, total.bounds, axis);
+                if (cost > 0 && cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = split;
+                }
+            }
+        }
+    }
+
+    uint32_t middle = (first + last) / 2;
+    if (bestAxis != -1) {
+        middle = std::stable_partition(order.begin() + first, order.begin() + last, [&](uint32_t light) {
+            return binOf(light, bestAxis) <= bestBin;
+        }) - order.begin();
+        if (middle == first || middle == last) {
+            middle = (first + last) / 2;
+        }
+    }
+
+    buildNode(lights, order, first, middle, trail, depth + 1);
+    uint32_t second = nodes.size();
+    buildNode(lights, order, middle, last, trail | (uint64_t(1) << depth), depth + 1);
+    nodes[pos] = {total, second, false};
+}
+
+int LightBVH::sample(const Point &p, const Point &n, float u, float &pmf) const {
+    if (nodes.empty() || nodes[0].bounds.importance(p, n) == 0) {
+        return -1;
+    }
+
+    pmf = 1;
+    uint32_t pos = 0;
+    while (!nodes[pos].isLeaf) {
+        float first = nodes[pos + 1].bounds.importance(p, n);
+        float second = nodes[nodes[pos].child].bounds.importance(p, n);
+        if (first == 0 && second == 0) {
+            return -1;
+        }
+
+        // Reuse u for the next level by stretching the chosen part back to [0, 1).
+        float probability = first / (first + second);
+        if (u < probability) {
+            u = std::min(u / probability, 0x1.fffffep-1f);
+            pmf *= probability;
+            pos = pos + 1;
+        } else {
+            u = std::min((u - probability) / (1 - probability), 0x1.fffffep-1f);
+            pmf *= 1 - probability;
+            pos = nodes[pos].child;
+        }
+    }
+    return nodes[pos].child;
+}
+
+float LightBVH::pmf(const Point &p, const Point &n, uint32_t light) const {
+    if (nodes.empty() || nodes[0].bounds.importance(p, n) == 0) {
+        return 0;
+    }
+
+    float result = 1;
+    uint64_t trail = trails[light];
+    uint32_t pos = 0;
+    while (!nodes[pos].isLeaf) {
+        float first = nodes[pos + 1].bounds.importance(p, n);
+        float second = nodes[nodes[pos].child].bounds.importance(p, n);
+        if (first == 0 && second == 0) {
+            return 0;
+        }
+
+        float probability = first / (first + second);
+        if (trail & 1) {
+            result *= 1 - probability;
+            pos = nodes[pos].child;
+        } else {
+            result *= probability;
+            pos = pos + 1;
+        }
+        trail >>= 1;
+    }
+    return result;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "point.h"
+#include "figure.h"
+#include <cstdint>
+#include <vector>
+
+// Conservative bounds on a group of emitters: where they are, how much they emit
+// and in which directions (Conty Estevez and Kulla 2018). Emitting normals lie
+// within acos(cosThetaO) of axis, and light leaves a surface at most
+// acos(cosThetaE) away from its normal.
+struct LightBounds {
+    AABB bounds;
+    float power = 0;
+    Point axis = Point(0, 0, 1);
+    float cosThetaO = 1, cosThetaE = 1;
+    bool twoSided = false;
+
+    // Upper-bound-style estimate of the light reaching a surface at p facing n.
+    // Zero only if nothing in the group can light that surface.
+    float importance(const Point &p, const Point &n) const;
+};
+
+LightBounds unite(const LightBounds &a, const LightBounds &b);
+
+// Binary tree over the emitters with one light per leaf, used to pick a light
+// with probability proportional to the importance of the subtrees on the way
+// down. Nodes are in depth-first order like in BVH: the first child of an
+// interior node directly follows it, and child is the index of the second one.
+// In a leaf child is the index of the light.
+class LightBVH {
+public:
+    struct Node {
+        LightBounds bounds;
+        uint32_t child;
+        bool isLeaf;
+    };
+
+    std::vector<Node> nodes;
+    // Bit i of a light's trail tells which child leads to it at depth i.
+    std::vector<uint64_t> trails;
+
+    static constexpr int BINS = 12;
+    static constexpr int MAX_DEPTH = 64;
+
+    LightBVH() = default;
+    explicit LightBVH(const std::vector<LightBounds> &lights);
+
+    // Returns the picked light and its probability in pmf, or -1 if no light
+    // can reach the surface.
+    int sample(const Point &p, const Point &n, float u, float &pmf) const;
+    float pmf(const Point &p, const Point &n, uint32_t light) const;
+
+private:
+    void buildNode(const std::vector<LightBounds> &lights, std::vector<uint32_t> &order, uint32_t first,
+                   uint32_t last, uint64_t trail, int depth);
+};
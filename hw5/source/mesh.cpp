@@ -0,0 +1,333 @@
+#include "mesh.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+void Mesh::transform(const Point &position, const Rotation &rotation) {
+    auto toWorld = rotation.doth();
+    for (auto &vertex : vertices) {
+        vertex = toWorld.transform(vertex) + position;
+    }
+}
+
+AABB Mesh::bounds(uint32_t triangle) const {
+    AABB result;
+    result.extend(vertex(triangle, 0));
+    result.extend(vertex(triangle, 1));
+    result.extend(vertex(triangle, 2));
+    return result;
+}
+
+// Vertices are passed in the same order as for a TRIANGLE figure given by the
+// three corners, so that both agree on which side is the inside.
+std::optional<Intersection> Mesh::intersect(uint32_t triangle, const Ray &ray, bool require_normal) const {
+    const Point &a = vertex(triangle, 0);
+    Point b = vertex(triangle, 2) - a;
+    Point c = vertex(triangle, 1) - a;
+    auto intersection = intersectTriangleAndRay(a, b, c, b.inter(c), ray);
+    if (!intersection.has_value() || !require_normal) {
+        return intersection;
+    }
+    return computeSurface(triangle, ray, intersection.value());
+}
+
+// As intersectPlaneAndRay turns the normal towards the ray.
+Intersection Mesh::computeSurface(uint32_t triangle, const Ray &ray, const Intersection &hit) const {
+    const Point &a = vertex(triangle, 0);
+    Point n = (vertex(triangle, 2) - a).inter(vertex(triangle, 1) - a);
+    bool is_inside = ray.d * n > 0;
+    if (is_inside) {
+        n = -1.f * n;
+    }
+    return {hit.t, n.normalize(), is_inside};
+}
+
+// Resolves a 1-based (or negative, relative to the end) OBJ vertex reference.
+static std::optional<uint32_t> objIndex(const std::string &token, size_t vertexCount) {
+    std::string number = token.substr(0, token.find('/'));
+    long index;
+    size_t parsed;
+    try {
+        index = std::stol(number, &parsed);
+    } catch (const std::exception &) {
+        return {};
+    }
+    if (parsed != number.size()) {
+        return {};
+    }
+    if (index < 0) {
+        index += vertexCount;
+    } else {
+        index -= 1;
+    }
+    if (index < 0 || (size_t) index >= vertexCount || index > (long) UINT32_MAX) {
+        return {};
+    }
+    return {uint32_t(index)};
+}
+
+bool loadObj(std::istream &in, Mesh &mesh) {
+    std::string line;
+    std::vector<uint32_t> face;
+    for (int lineNumber = 1; getline(in, line); lineNumber++) {
+        std::stringstream ss;
+        ss << line;
+        std::string command;
+        ss >> command;
+
+        if (command == "v") {
+            float x, y, z;
+            if (!(ss >> x >> y >> z)) {
+                std::cerr << "Bad OBJ vertex at line " << lineNumber << ": " << line << std::endl;
+                return false;
+            }
+            mesh.vertices.emplace_back(x, y, z);
+        } else if (command == "f") {
+            face.clear();
+            std::string token;
+            while (ss >> token) {
+                auto index = objIndex(token, mesh.vertices.size());
+                if (!index.has_value()) {
+                    std::cerr << "Bad OBJ face at line " << lineNumber << ": " << line << std::endl;
+                    return false;
+                }
+                face.push_back(index.value());
+            }
+            if (face.size() < 3) {
+                std::cerr << "OBJ face with fewer than 3 vertices at line " << lineNumber << ": " << line
+                          << std::endl;
+                return false;
+            }
+            for (size_t i = 2; i < face.size(); i++) {
+                mesh.indices.insert(mesh.indices.end(), {face[0], face[i - 1], face[i]});
+            }
+        }
+    }
+    return true;
+}
+
+namespace {
+
+struct PlyProperty {
+    std::string name;
+    std::string type;
+    // Set for list properties, whose length is stored before the items.
+    std::string countType;
+};
+
+struct PlyElement {
+    std::string name;
+    size_t count;
+    std::vector<PlyProperty> properties;
+};
+
+int plyTypeSize(const std::string &type) {
+    if (type == "char" || type == "uchar" || type == "int8" || type == "uint8") {
+        return 1;
+    } else if (type == "short" || type == "ushort" || type == "int16" || type == "uint16") {
+        return 2;
+    } else if (type == "int" || type == "uint" || type == "int32" || type == "uint32" || type == "float" ||
+               type == "float32") {
+        return 4;
+    } else if (type == "double" || type == "float64") {
+        return 8;
+    }
+    return 0;
+}
+
+template <typename T>
+double plyCast(const char *bytes) {
+    T value;
+    std::memcpy(&value, bytes, sizeof(T));
+    return double(value);
+}
+
+bool readPlyValue(std::istream &in, const std::string &type, bool swapBytes, double &value) {
+    char bytes[8];
+    int size = plyTypeSize(type);
+    if (size == 0 || !in.read(bytes, size)) {
+        return false;
+    }
+    if (swapBytes) {
+        std::reverse(bytes, bytes + size);
+    }
+
+    if (type == "char" || type == "int8") {
+        value = plyCast<int8_t>(bytes);
+    } else if (type == "uchar" || type == "uint8") {
+        value = plyCast<uint8_t>(bytes);
+    } else if (type == "short" || type == "int16") {
+        value = plyCast<int16_t>(bytes);
+    } else if (type == "ushort" || type == "uint16") {
+        value = plyCast<uint16_t>(bytes);
+    } else if (type == "int" || type == "int32") {
+        value = plyCast<int32_t>(bytes);
+    } else if (type == "uint" || type == "uint32") {
+        value = plyCast<uint32_t>(bytes);
+    } else if (type == "float" || type == "float32") {
+        value = plyCast<float>(bytes);
+    } else {
+        value = plyCast<double>(bytes);
+    }
+    return true;
+}
+
+}
+
+bool loadPly(std::istream &in, Mesh &mesh) {
+    std::string line;
+    getline(in, line);
+    if (line.rfind("ply", 0) != 0) {
+        std::cerr << "Not a PLY file" << std::endl;
+        return false;
+    }
+
+    std::vector<PlyElement> elements;
+    bool bigEndian = false;
+    while (getline(in, line)) {
+        std::stringstream ss;
+        ss << line;
+        std::string command;
+        ss >> command;
+
+        if (command == "format") {
+            std::string format;
+            ss >> format;
+            if (format == "binary_big_endian") {
+                bigEndian = true;
+            } else if (format != "binary_little_endian") {
+                std::cerr << "Unsupported PLY format: " << format << std::endl;
+                return false;
+            }
+        } else if (command == "element") {
+            PlyElement element;
+            ss >> element.name >> element.count;
+            elements.push_back(element);
+        } else if (command == "property") {
+            if (elements.empty()) {
+                std::cerr << "PLY property outside of an element" << std::endl;
+                return false;
+            }
+            PlyProperty property;
+            ss >> property.type;
+            if (property.type == "list") {
+                ss >> property.countType >> property.type;
+            }
+            ss >> property.name;
+            if (plyTypeSize(property.type) == 0 ||
+                (!property.countType.empty() && plyTypeSize(property.countType) == 0)) {
+                std::cerr << "Unsupported PLY property type: " << line << std::endl;
+                return false;
+            }
+            elements.back().properties.push_back(property);
+        } else if (command == "end_header") {
+            break;
+        }
+    }
+
+    uint16_t probe = 1;
+    bool swapBytes = bigEndian == (*reinterpret_cast<char *>(&probe) == 1);
+
+    // Faces are checked against the vertex count of the header, so an index
+    // is known to fit before it is narrowed, whatever order the elements are in.
+    size_t vertexCount = 0;
+    for (const auto &element : elements) {
+        if (element.name == "vertex") {
+            vertexCount += element.count;
+        }
+    }
+
+    std::vector<uint32_t> face;
+    for (const auto &element : elements) {
+        if (element.name == "vertex") {
+            mesh.vertices.reserve(element.count);
+        } else if (element.name == "face") {
+            mesh.indices.reserve(3 * element.count);
+        }
+
+        for (size_t i = 0; i < element.count; i++) {
+            Point vertex(0, 0, 0);
+            face.clear();
+            for (const auto &property : element.properties) {
+                double value;
+                if (property.countType.empty()) {
+                    if (!readPlyValue(in, property.type, swapBytes, value)) {
+                        std::cerr << "Unexpected end of PLY data" << std::endl;
+                        return false;
+                    }
+                    if (property.name == "x") {
+                        vertex.x = value;
+                    } else if (property.name == "y") {
+                        vertex.y = value;
+                    } else if (property.name == "z") {
+                        vertex.z = value;
+                    }
+                    continue;
+                }
+
+                double count;
+                if (!readPlyValue(in, property.countType, swapBytes, count)) {
+                    std::cerr << "Unexpected end of PLY data" << std::endl;
+                    return false;
+                }
+                // Also rejects NaN, which fails every comparison.
+                if (!(count >= 0 && count <= UINT32_MAX)) {
+                    std::cerr << "Bad PLY list length: " << count << std::endl;
+                    return false;
+                }
+                for (size_t j = 0; j < size_t(count); j++) {
+                    if (!readPlyValue(in, property.type, swapBytes, value)) {
+                        std::cerr << "Unexpected end of PLY data" << std::endl;
+                        return false;
+                    }
+                    if (property.name == "vertex_indices" || property.name == "vertex_index") {
+                        if (!(value >= 0 && value < vertexCount)) {
+                            std::cerr << "PLY face references a missing vertex: " << value << std::endl;
+                            return false;
+                        }
+                        face.push_back(uint32_t(value));
+                    }
+                }
+            }
+
+            if (element.name == "vertex") {
+                mesh.vertices.push_back(vertex);
+            } else if (element.name == "face") {
+                for (size_t j = 2; j < face.size(); j++) {
+                    mesh.indices.insert(mesh.indices.end(), {face[0], face[j - 1], face[j]});
+                }
+            }
+        }
+    }
+    return true;
+}
+
+Mesh loadMeshFromFile(const std::string &path) {
+    Mesh mesh;
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        std::cerr << "Cannot open mesh: " << path << std::endl;
+        return mesh;
+    }
+
+    std::string extension = path.substr(path.find_last_of('.') + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+    bool loaded;
+    if (extension == "obj") {
+        loaded = loadObj(in, mesh);
+    } else if (extension == "ply") {
+        loaded = loadPly(in, mesh);
+    } else {
+        std::cerr << "Unknown mesh format: " << path << std::endl;
+        loaded = false;
+    }
+
+    if (!loaded) {
+        return {};
+    }
+    return mesh;
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <istream>
+#include <optional>
+#include <string>
+#include <vector>
+#include "point.h"
+#include "figure.h"
+
+// Triangles sharing one vertex buffer. A MESH figure owns one of these and gives
+// it its material; every triangle goes into the scene BVH on its own.
+class Mesh {
+public:
+    std::vector<Point> vertices;
+    // Three vertex indices per triangle.
+    std::vector<uint32_t> indices;
+
+    Mesh() = default;
+
+    size_t size() const;
+    const Point &vertex(uint32_t triangle, int corner) const;
+
+    // Moves the vertices from the figure's local frame into the world.
+    void transform(const Point &position, const Rotation &rotation);
+
+    AABB bounds(uint32_t triangle) const;
+    std::optional<Intersection> intersect(uint32_t triangle, const Ray &ray, bool require_normal = true) const;
+    // Fills in the normal of a hit found by intersect(triangle, ray, false).
+    Intersection computeSurface(uint32_t triangle, const Ray &ray, const Intersection &hit) const;
+};
+
+inline size_t Mesh::size() const {
+    return indices.size() / 3;
+}
+
+inline const Point &Mesh::vertex(uint32_t triangle, int corner) const {
+    return vertices[indices[3 * triangle + corner]];
+}
+
+bool loadObj(std::istream &in, Mesh &mesh);
+bool loadPly(std::istream &in, Mesh &mesh);
+
+// Picks the format by the extension (.obj or .ply). Prints an error and returns
+// an empty mesh if the file cannot be read.
+Mesh loadMeshFromFile(const std::string &path);
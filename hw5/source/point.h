@@ -1,7 +1,7 @@
 #ifndef HW1_POINT_H
 #define HW1_POINT_H
 
-#include <valarray>
+#include <cmath>
 
 class Point {
 public:
@@ -16,6 +16,7 @@ public:
     float operator* (const Point &p) const;
     Point operator^ (const Point &p) const;
     float len_square() const;
+    float operator[] (int axis) const;
 
     Point normalize() const;
 
@@ -46,8 +47,12 @@ inline float Point::len_square() const {
     return (*this) * (*this);
 }
 
+inline float Point::operator[] (int axis) const {
+    return axis == 0 ? x : (axis == 1 ? y : z);
+}
+
 inline Point Point::normalize() const {
-    return std::sqrt(1.0 / len_square()) * (*this);
+    return (1.f / std::sqrt(len_square())) * (*this);
 }
 
 inline Point Point::inter(const Point &p) const {
@@ -0,0 +1,66 @@
+#pragma once
+#include <cstdint>
+#include <limits>
+
+// Counter-based generator (Philox4x32-10). Every output is a pure function of the
+// key (pixel, seed) and the counter (sample, bounce, dimension), so there is no
+// state shared between threads and a render does not depend on the schedule.
+// Satisfies UniformRandomBitGenerator, so it works with the std distributions.
+class Philox {
+public:
+    using result_type = uint32_t;
+
+    Philox(uint32_t pixel, uint32_t sample, uint32_t seed = 0);
+
+    // Moves to the first dimension of the given bounce of the current sample.
+    void setBounce(uint32_t bounce);
+
+    result_type operator()();
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+private:
+    uint32_t key[2];
+    uint32_t sample, bounce, dimension;
+    uint32_t block[4];
+
+    void generate();
+};
+
+inline Philox::Philox(uint32_t pixel, uint32_t sample, uint32_t seed): key{pixel, seed}, sample(sample), bounce(0),
+                                                                      dimension(0), block{} {}
+
+inline void Philox::setBounce(uint32_t newBounce) {
+    bounce = newBounce;
+    dimension = 0;
+}
+
+inline Philox::result_type Philox::operator()() {
+    if (dimension % 4 == 0) {
+        generate();
+    }
+    return block[dimension++ % 4];
+}
+
+inline void Philox::generate() {
+    const uint32_t M0 = 0xD2511F53, M1 = 0xCD9E8D57;
+    const uint32_t W0 = 0x9E3779B9, W1 = 0xBB67AE85;
+
+    uint32_t c[4] = {dimension / 4, bounce, sample, 0};
+    uint32_t k0 = key[0], k1 = key[1];
+    for (int round = 0; round < 10; round++) {
+        uint64_t p0 = uint64_t(M0) * c[0];
+        uint64_t p1 = uint64_t(M1) * c[2];
+        uint32_t next[4] = {uint32_t(p1 >> 32) ^ c[1] ^ k0, uint32_t(p1), uint32_t(p0 >> 32) ^ c[3] ^ k1,
+                            uint32_t(p0)};
+        for (int i = 0; i < 4; i++) {
+            c[i] = next[i];
+        }
+        k0 += W0;
+        k1 += W1;
+    }
+    for (int i = 0; i < 4; i++) {
+        block[i] = c[i];
+    }
+}
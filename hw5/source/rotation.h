@@ -3,6 +3,28 @@
 
 #include "point.h"
 
+// Row-major 3x3 matrix, used to apply a rotation without quaternion products.
+class Matrix {
+public:
+    Point rows[3];
+
+    Matrix() : rows{{1, 0, 0}, {0, 1, 0}, {0, 0, 1}} {};
+
+    Point transform(const Point &p) const;
+    // Applies the transpose, which undoes transform() for a rotation.
+    Point transformTransposed(const Point &p) const;
+};
+
+inline Point Matrix::transform(const Point &p) const {
+    return {rows[0] * p, rows[1] * p, rows[2] * p};
+}
+
+inline Point Matrix::transformTransposed(const Point &p) const {
+    return {rows[0].x * p.x + rows[1].x * p.y + rows[2].x * p.z,
+            rows[0].y * p.x + rows[1].y * p.y + rows[2].y * p.z,
+            rows[0].z * p.x + rows[1].z * p.y + rows[2].z * p.z};
+}
+
 class Rotation {
 public:
     Point v;
@@ -15,6 +37,9 @@ public:
     Rotation operator+ (const Rotation &r) const;
     Rotation operator* (const Rotation &r) const;
     Point transform(const Point &p) const;
+    // The same linear map as transform().
+    Matrix matrix() const;
+    bool isIdentity() const;
 
     Rotation doth() const;
 };
@@ -28,7 +53,7 @@ inline Rotation Rotation::operator+ (const Rotation &r) const {
 }
 
 inline Rotation Rotation::doth() const {
-    return {-1.0 * v, w};
+    return {-1.f * v, w};
 }
 
 inline Rotation Rotation::operator* (const Rotation &r) const {
@@ -39,8 +64,27 @@ inline Rotation Rotation::operator* (const Rotation &r) const {
     return {w * r.v + r.w * v + Point(n_x, n_y, n_z), w * r.w - v * r.v};
 }
 
+// q p q* expanded. The product above takes the cross product in the opposite
+// order, so this is (w^2 - v.v) p + 2 (v.p) v - 2w (v x p), where
+// v.inter(p) = -(v x p).
 inline Point Rotation::transform(const Point &p) const {
-    return ((*this) * Rotation(p.x, p.y, p.z, 0.0) * Rotation(-1.0 * v, w)).v;
+    return (w * w - v * v) * p + (2 * (v * p)) * v + (2 * w) * v.inter(p);
+}
+
+inline Matrix Rotation::matrix() const {
+    Point x = transform({1, 0, 0});
+    Point y = transform({0, 1, 0});
+    Point z = transform({0, 0, 1});
+
+    Matrix result;
+    result.rows[0] = {x.x, y.x, z.x};
+    result.rows[1] = {x.y, y.y, z.y};
+    result.rows[2] = {x.z, y.z, z.z};
+    return result;
+}
+
+inline bool Rotation::isIdentity() const {
+    return v.x == 0 && v.y == 0 && v.z == 0 && w == 1;
 }
 
 #endif //HW1_ROTATION_H
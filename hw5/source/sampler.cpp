@@ -0,0 +1,177 @@
+#include "sampler.h"
+#include <algorithm>
+
+static uint32_t reverseBits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+static uint32_t mixBits(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+static uint32_t hash(uint32_t a, uint32_t b, uint32_t c = 0) {
+    return mixBits(a ^ mixBits(b ^ mixBits(c + 0x9e3779b9u)));
+}
+
+// Owen scrambling of a 32-bit fixed point number in [0, 1) (Burley 2020): the
+// Laine-Karras hash applied to the reversed bits flips every bit depending only
+// on the bits above it.
+static uint32_t nestedUniformScramble(uint32_t x, uint32_t seed) {
+    x = reverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverseBits(x);
+}
+
+// Element i of a pseudo-random permutation of [0, l) selected by p (Kensler 2013).
+static uint32_t permute(uint32_t i, uint32_t l, uint32_t p) {
+    uint32_t w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= p;
+        i *= 0xe170893du;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3fu;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69u;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303u;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3dfu;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= l);
+    return (i + p) % l;
+}
+
+static float toFloat(uint32_t x) {
+    return float(x >> 8) * 0x1p-24f;
+}
+
+// The first two dimensions of the Sobol sequence.
+static uint32_t sobolX(uint32_t index) {
+    return reverseBits(index);
+}
+
+static uint32_t sobolY(uint32_t index) {
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+        if (index & 1) {
+            result ^= v;
+        }
+    }
+    return result;
+}
+
+static const uint32_t PRIMES[] = {
+        2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+        59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131,
+        137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
+        227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311
+};
+static const uint32_t PRIME_COUNT = sizeof(PRIMES) / sizeof(PRIMES[0]);
+
+Sampler::Sampler(SamplerType type, uint32_t pixel, uint32_t sample): type(type), pixel(pixel), sample(sample),
+                                                                     rng(pixel, sample) {}
+
+void Sampler::setBounce(uint32_t newBounce) {
+    bounce = newBounce;
+    dimension = 0;
+    rng.setBounce(newBounce);
+}
+
+float Sampler::random() {
+    return toFloat(rng());
+}
+
+float Sampler::get1D() {
+    if (type == SamplerType::RANDOM || dimension >= DIMENSIONS_PER_BOUNCE) {
+        dimension++;
+        return random();
+    }
+
+    uint32_t dim = bounce * DIMENSIONS_PER_BOUNCE + dimension++;
+    if (type == SamplerType::SOBOL) {
+        return sobol1D(dim);
+    }
+    if (dim >= PRIME_COUNT) {
+        return random();
+    }
+    return halton(dim);
+}
+
+std::pair<float, float> Sampler::get2D() {
+    if (type == SamplerType::RANDOM || dimension + 2 > DIMENSIONS_PER_BOUNCE) {
+        dimension += 2;
+        float x = random();
+        return {x, random()};
+    }
+
+    uint32_t dim = bounce * DIMENSIONS_PER_BOUNCE + dimension;
+    dimension += 2;
+    if (type == SamplerType::SOBOL) {
+        return sobol2D(dim);
+    }
+    if (dim + 1 >= PRIME_COUNT) {
+        float x = random();
+        return {x, random()};
+    }
+    return {halton(dim), halton(dim + 1)};
+}
+
+// Sobol dimensions are padded: every request gets its own copy of the first one
+// or two Sobol dimensions, with the sample order shuffled per pixel and dimension
+// and the values Owen scrambled, which keeps each of them well stratified.
+float Sampler::sobol1D(uint32_t dim) const {
+    uint32_t index = nestedUniformScramble(sample, hash(pixel, dim, 1));
+    return toFloat(nestedUniformScramble(sobolX(index), hash(pixel, dim, 2)));
+}
+
+std::pair<float, float> Sampler::sobol2D(uint32_t dim) const {
+    uint32_t index = nestedUniformScramble(sample, hash(pixel, dim, 1));
+    return {toFloat(nestedUniformScramble(sobolX(index), hash(pixel, dim, 2))),
+            toFloat(nestedUniformScramble(sobolY(index), hash(pixel, dim, 3)))};
+}
+
+// Owen-scrambled radical inverse of the sample index in the dim-th prime base:
+// each digit goes through a random permutation selected by the digits before it
+// and by the pixel.
+float Sampler::halton(uint32_t dim) const {
+    uint32_t base = PRIMES[dim];
+    uint32_t seed = hash(pixel, dim, 4);
+    uint32_t a = sample;
+
+    double invBase = 1.0 / base, invBaseM = 1;
+    uint64_t reversedDigits = 0;
+    for (uint32_t digitIndex = 0; invBaseM >= 0x1p-24; digitIndex++) {
+        uint32_t next = a / base;
+        uint32_t digit = a - next * base;
+        digit = permute(digit, base, hash(seed, uint32_t(reversedDigits), digitIndex));
+        reversedDigits = reversedDigits * base + digit;
+        invBaseM *= invBase;
+        a = next;
+    }
+    return std::min(float(reversedDigits * invBaseM), 0x1.fffffep-1f);
+}
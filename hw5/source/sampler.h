@@ -0,0 +1,36 @@
+#pragma once
+#include <cstdint>
+#include <utility>
+#include "random.h"
+
+enum class SamplerType {
+    RANDOM, SOBOL, HALTON
+};
+
+// Hands out the random numbers of one pixel sample. Every bounce owns a block of
+// DIMENSIONS_PER_BOUNCE dimensions (bounce 0 is the camera ray), which are given
+// out in the order they are asked for; the low-discrepancy samplers keep each of
+// them stratified across the samples of a pixel. Draws past the end of the block,
+// e.g. from rejection loops, come from the Philox generator.
+class Sampler {
+public:
+    static constexpr uint32_t DIMENSIONS_PER_BOUNCE = 8;
+
+    Sampler(SamplerType type, uint32_t pixel, uint32_t sample);
+
+    void setBounce(uint32_t bounce);
+
+    float get1D();
+    std::pair<float, float> get2D();
+
+private:
+    SamplerType type;
+    uint32_t pixel, sample;
+    uint32_t bounce = 0, dimension = 0;
+    Philox rng;
+
+    float random();
+    float sobol1D(uint32_t dim) const;
+    std::pair<float, float> sobol2D(uint32_t dim) const;
+    float halton(uint32_t dim) const;
+};
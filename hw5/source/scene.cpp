@@ -1,16 +1,53 @@
 #include "scene.h"
 #include "distribution.h"
+#include "scheduler.h"
+#include "wavefront.h"
 #include <string>
 #include <sstream>
 #include <cmath>
 #include <random>
 #include <thread>
 #include <mutex>
+#include <array>
+#include <chrono>
+#include <omp.h>
+#include <algorithm>
+#include <fstream>
+#include <map>
+
+// FNV-1a of size bytes continued from hash.
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t size) {
+    auto bytes = static_cast<const uint8_t *>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3;
+    }
+    return hash;
+}
 
-static std::minstd_rand rnd;
+// FNV-1a of the text continued from hash, with a line break after it.
+static uint64_t hashLine(uint64_t hash, const std::string &text) {
+    std::string line = text + '\n';
+    return hashBytes(hash, line.data(), line.size());
+}
+
+// Commands that do not change what a sample estimates, so a checkpoint stays
+// valid across changes to them. The traversal and render modes only change how
+// the same hits are found.
+static bool keepsCheckpoint(const std::string &command) {
+    return command == "SAMPLES" || command == "CHECKPOINT" || command == "CHECKPOINT_INTERVAL" ||
+           command == "AOV_ALBEDO" || command == "AOV_NORMAL" || command == "AOV_DEPTH" ||
+           command == "SAMPLE_MAP" || command == "DENOISE" || command == "BVH_WIDTH" ||
+           command == "PRIMITIVE_ARRAYS" || command == "WAVEFRONT" || command.empty();
+}
 
 Scene loadSceneFromFile(std::istream &in) {
     Scene scene;
+    uint64_t fingerprint = 0xcbf29ce484222325;
+    // The material of every figure, deduplicated into scene.materials once the
+    // whole file is read.
+    std::vector<MaterialData> materials;
+    // What prepare() reads of every figure besides the figure itself.
+    std::vector<FigureInput> inputs;
 
     std::string line;
     while (getline(in, line)) {
@@ -20,6 +57,9 @@ Scene loadSceneFromFile(std::istream &in) {
             std::stringstream ss;
             ss << line;
             ss >> command;
+            if (!keepsCheckpoint(command)) {
+                fingerprint = hashLine(fingerprint, line);
+            }
 
             if (command == "DIMENSIONS") {
                 ss >> scene.width >> scene.height;
@@ -47,6 +87,7 @@ Scene loadSceneFromFile(std::istream &in) {
                 ss >> scene.cameraFovX;
             } else if (command == "NEW_PRIMITIVE") {
                 getline(in, line);
+                fingerprint = hashLine(fingerprint, line);
 
                 std::stringstream ss2;
                 ss2 << line;
@@ -54,6 +95,7 @@ Scene loadSceneFromFile(std::istream &in) {
                 ss2 >> name;
 
                 Figure figure = Figure();
+                FigureInput input;
 
                 if (name == "PLANE") {
                     float x, y, z;
@@ -82,49 +124,125 @@ Scene loadSceneFromFile(std::istream &in) {
                     ss2 >> x >> y >> z;
                     Point p3(x, y, z);
                     figure.data = p3;
-                    figure.data2 = p2;
+                    input.data2 = p2;
                     figure.data3 = p1;
                     figure.type = FigureType::TRIANGLE;
+                } else if (name == "MESH") {
+                    std::string path;
+                    ss2 >> path;
+                    figure.type = FigureType::MESH;
+                    figure.mesh = scene.meshes.size();
+                    scene.meshes.push_back(loadMeshFromFile(path));
+                    // The line names the file only, so the checkpoint also
+                    // depends on what was loaded from it.
+                    const Mesh &mesh = scene.meshes.back();
+                    fingerprint = hashBytes(fingerprint, mesh.vertices.data(), mesh.vertices.size() * sizeof(Point));
+                    fingerprint = hashBytes(fingerprint, mesh.indices.data(),
+                                            mesh.indices.size() * sizeof(uint32_t));
                 } else {
                     std::cerr << "Unknown figure: " << name << std::endl;
                 }
 
                 scene.figures.push_back(figure);
+                materials.emplace_back();
+                inputs.push_back(input);
             } else if (command == "POSITION") {
                 auto last_f = &scene.figures.back();
                 float x, y, z;
                 ss >> x >> y >> z;
                 last_f->position = Point(x, y, z);
             } else if (command == "ROTATION") {
-                auto last_f = &scene.figures.back();
+                auto last_i = &inputs.back();
                 float x, y, z, w;
                 ss >> x >> y >> z >> w;
-                last_f->rotation = Rotation(x, y, z, w);
+                last_i->rotation = Rotation(x, y, z, w);
             } else if (command == "COLOR") {
-                auto last_f = &scene.figures.back();
+                auto last_m = &materials.back();
                 float r, g, b;
                 ss >> r >> g >> b;
-                last_f->color = Color(r, g, b);
+                last_m->color = Color(r, g, b);
             } else if (command == "METALLIC") {
-                auto last_f = &scene.figures.back();
-                last_f->material = Material::METALLIC;
+                auto last_m = &materials.back();
+                last_m->type = Material::METALLIC;
             } else if (command == "DIELECTRIC") {
-                auto last_f = &scene.figures.back();
-                last_f->material = Material::DIELECTRIC;
+                auto last_m = &materials.back();
+                last_m->type = Material::DIELECTRIC;
             } else if (command == "IOR") {
-                auto last_f = &scene.figures.back();
+                auto last_m = &materials.back();
                 float ior;
                 ss >> ior;
-                last_f->ior = ior;
+                last_m->ior = ior;
             } else if (command == "EMISSION") {
-                auto last_f = &scene.figures.back();
+                auto last_m = &materials.back();
                 float r, g, b;
                 ss >> r >> g >> b;
-                last_f->emission = Color(r, g, b);
+                last_m->emission = Color(r, g, b);
             } else if (command == "RAY_DEPTH") {
                 ss >> scene.rayDepth;
             } else if (command == "SAMPLES") {
                 ss >> scene.samples;
+            } else if (command == "SAMPLER") {
+                std::string type;
+                ss >> type;
+                if (type == "RANDOM") {
+                    scene.sampler = SamplerType::RANDOM;
+                } else if (type == "SOBOL") {
+                    scene.sampler = SamplerType::SOBOL;
+                } else if (type == "HALTON") {
+                    scene.sampler = SamplerType::HALTON;
+                } else {
+                    std::cerr << "Unknown sampler: " << type << std::endl;
+                }
+            } else if (command == "TRIANGLE_LIGHT_SAMPLING") {
+                std::string type;
+                ss >> type;
+                if (type == "AREA") {
+                    scene.sphericalTriangleLights = false;
+                } else if (type == "SOLID_ANGLE") {
+                    scene.sphericalTriangleLights = true;
+                } else {
+                    std::cerr << "Unknown triangle light sampling: " << type << std::endl;
+                }
+            } else if (command == "ADAPTIVE_THRESHOLD") {
+                ss >> scene.adaptiveThreshold;
+            } else if (command == "ADAPTIVE_MIN_SAMPLES") {
+                ss >> scene.adaptiveMinSamples;
+            } else if (command == "CHECKPOINT") {
+                ss >> scene.checkpointPath;
+            } else if (command == "CHECKPOINT_INTERVAL") {
+                ss >> scene.checkpointInterval;
+            } else if (command == "DENOISE") {
+                scene.denoise = true;
+                int iterations;
+                if (ss >> iterations) {
+                    scene.denoiser.iterations = iterations;
+                }
+            } else if (command == "WAVEFRONT") {
+                scene.wavefront = true;
+                int batch;
+                if (ss >> batch) {
+                    scene.wavefrontBatch = batch;
+                }
+            } else if (command == "AOV_ALBEDO") {
+                ss >> scene.albedoPath;
+            } else if (command == "AOV_NORMAL") {
+                ss >> scene.normalPath;
+            } else if (command == "AOV_DEPTH") {
+                ss >> scene.depthPath;
+            } else if (command == "SAMPLE_MAP") {
+                ss >> scene.sampleMapPath;
+            } else if (command == "BVH_WIDTH") {
+                ss >> scene.bvhWidth;
+            } else if (command == "PRIMITIVE_ARRAYS") {
+                std::string mode;
+                ss >> mode;
+                if (mode == "ON") {
+                    scene.primitiveArrays = true;
+                } else if (mode == "OFF") {
+                    scene.primitiveArrays = false;
+                } else {
+                    std::cerr << "Unknown primitive arrays mode: " << mode << std::endl;
+                }
             } else {
                 std::cerr << "Unknown command: " << command << std::endl;
             }
@@ -132,164 +250,548 @@ Scene loadSceneFromFile(std::istream &in) {
         }
     }
 
+    // The sampler settings are in the file already, but their defaults are not.
+    fingerprint = hashLine(fingerprint, std::to_string(int(scene.sampler)) + " " + std::to_string(scene.rayDepth));
+    scene.fingerprint = fingerprint;
+
+    std::map<MaterialData, uint32_t> known;
+    for (size_t i = 0; i < scene.figures.size(); i++) {
+        auto [it, added] = known.emplace(materials[i], scene.materials.size());
+        if (added) {
+            scene.materials.push_back(materials[i]);
+        }
+        scene.figures[i].material = it->second;
+    }
+
+    for (size_t i = 0; i < scene.figures.size(); i++) {
+        Figure &figure = scene.figures[i];
+        figure.prepare(inputs[i]);
+        if (figure.type == FigureType::MESH) {
+            scene.meshes[figure.mesh].transform(figure.position, inputs[i].rotation);
+        }
+    }
+
     scene.bvhble = std::partition(scene.figures.begin(), scene.figures.end(), [](const auto &elem) {
         return elem.type != FigureType::PLANE;
     }) - scene.figures.begin();
-    scene.bvh = BVH(scene.figures, scene.bvhble);
 
-    auto lightDistribution = FiguresMix(scene.figures);
-    std::vector<std::variant<Cosine, FiguresMix>> finalDistributions;
-    finalDistributions.emplace_back(Cosine());
-    if (!lightDistribution.isEmpty()) {
-        finalDistributions.emplace_back(lightDistribution);
+    for (int i = 0; i < scene.bvhble; i++) {
+        const Figure &figure = scene.figures[i];
+        if (figure.type != FigureType::MESH) {
+            scene.primitives.push_back({uint32_t(i), 0});
+            continue;
+        }
+        const Mesh &mesh = scene.meshes[figure.mesh];
+        for (uint32_t t = 0; t < mesh.size(); t++) {
+            scene.primitives.push_back({uint32_t(i), t});
+        }
+    }
+
+    std::vector<AABB> bounds(scene.primitives.size());
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < bounds.size(); i++) {
+        const Primitive &primitive = scene.primitives[i];
+        const Figure &figure = scene.figures[primitive.figure];
+        if (figure.type == FigureType::MESH) {
+            bounds[i] = scene.meshes[figure.mesh].bounds(primitive.triangle);
+        } else {
+            bounds[i] = AABB(figure);
+        }
+    }
+    auto order = scene.bvh.build(bounds, scene.primitiveArrays ? PrimitiveStorage::BATCH : 1);
+    std::vector<Primitive> sorted(order.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        sorted[i] = scene.primitives[order[i]];
+    }
+    scene.primitives = std::move(sorted);
+    scene.bvh.widen(scene.bvhWidth);
+    if (scene.primitiveArrays) {
+        scene.storage.build(scene.figures, scene.meshes, scene.bvh, scene.primitives);
     }
-    scene.distribution = Mix(finalDistributions);
+
+    scene.lights = FiguresMix(scene.figures, scene.materials, scene.sphericalTriangleLights);
 
     return scene;
 }
 
+std::optional<Intersection> Scene::intersectPrimitive(uint32_t i, const Ray &ray, bool require_normal) const {
+    const Primitive &primitive = primitives[i];
+    const Figure &figure = figures[primitive.figure];
+    if (figure.type == FigureType::MESH) {
+        return meshes[figure.mesh].intersect(primitive.triangle, ray, require_normal);
+    }
+    return figure.intersect(ray, require_normal);
+}
+
+Intersection Scene::computeSurface(uint32_t i, const Ray &ray, const Intersection &hit) const {
+    const Primitive &primitive = primitives[i];
+    const Figure &figure = figures[primitive.figure];
+    if (figure.type == FigureType::MESH) {
+        return meshes[figure.mesh].computeSurface(primitive.triangle, ray, hit);
+    }
+    return figure.computeSurface(ray, hit);
+}
+
 std::optional<std::pair<Intersection, int>> Scene::findIntersection(Ray ray) const {
-    std::optional<std::pair<Intersection, int>> bestIntersection = {};
+    // Candidates are compared by distance only; the normal is computed once,
+    // for the closest of them.
+    std::optional<Intersection> closest;
+    int closestPlane = -1;
     for (int i = bvhble; i < (int) figures.size(); i++) {
-        auto intersection_ = figures[i].intersect(ray);
-        if (intersection_.has_value()) {
-            auto intersection = intersection_.value();
-            if (!bestIntersection.has_value() || intersection.t < bestIntersection.value().first.t) {
-                bestIntersection = {intersection, i};
+        auto intersection = figures[i].intersect(ray, false);
+        if (intersection.has_value() && (!closest.has_value() || intersection.value().t < closest.value().t)) {
+            closest = intersection;
+            closestPlane = i;
+        }
+    }
+
+    float best = closest.has_value() ? closest.value().t : INFINITY;
+    if (primitiveArrays) {
+        std::optional<StoredHit> hit;
+        bvh.traverse(ray, best, [&](uint32_t first, uint32_t, float &best) {
+            storage.closest(first, ray, best, hit);
+        });
+        if (hit.has_value()) {
+            return storage.computeSurface(hit.value(), ray, best, figures);
+        }
+    } else {
+        int closestPrimitive = -1;
+        bvh.traverse(ray, best, [&](uint32_t first, uint32_t count, float &best) {
+            for (uint32_t i = first; i < first + count; i++) {
+                auto intersection = intersectPrimitive(i, ray, false);
+                if (intersection.has_value() && intersection.value().t < best) {
+                    best = intersection.value().t;
+                    closest = intersection;
+                    closestPrimitive = i;
+                }
             }
+        });
+        if (closestPrimitive >= 0) {
+            return {{computeSurface(closestPrimitive, ray, closest.value()),
+                     static_cast<int>(primitives[closestPrimitive].figure)}};
         }
     }
-    std::optional<float> curBest = {};
-    if (bestIntersection.has_value()) {
-        curBest = bestIntersection.value().first.t;
+
+    if (!closest.has_value()) {
+        return {};
+    }
+    return {{figures[closestPlane].computeSurface(ray, closest.value()), closestPlane}};
+}
+
+bool Scene::occluded(const Ray &ray, float tMax) const {
+    for (int i = bvhble; i < (int) figures.size(); i++) {
+        if (figures[i].occludes(ray, tMax)) {
+            return true;
+        }
     }
-    auto bvhIntersection = bvh.intersect(figures, ray, curBest);
-    if (bvhIntersection.has_value() && (!bestIntersection.has_value() || bvhIntersection.value().first.t < bestIntersection.value().first.t)) {
-        bestIntersection = bvhIntersection;
+
+    bool hit = false;
+    if (primitiveArrays) {
+        bvh.traverse(ray, tMax, [&](uint32_t first, uint32_t, float &best) {
+            if (storage.occludes(first, ray, best)) {
+                hit = true;
+                best = -1;
+            }
+        });
+        return hit;
     }
-    return bestIntersection;
+
+    bvh.traverse(ray, tMax, [&](uint32_t first, uint32_t count, float &best) {
+        for (uint32_t i = first; i < first + count; i++) {
+            auto intersection = intersectPrimitive(i, ray, false);
+            if (intersection.has_value() && intersection.value().t < best) {
+                hit = true;
+                best = -1;
+                return;
+            }
+        }
+    });
+    return hit;
 }
 
-Color Scene::getPixelColor(std::uniform_real_distribution<float> u01, std::normal_distribution<float> n01, rng_type &rng, Ray ray, int bounceNum) const {
-    if (bounceNum == 0)
-        return {};
+static bool isBlack(const Color &c) {
+    return c.r == 0 && c.g == 0 && c.b == 0;
+}
 
-    auto intersectionResult = findIntersection(ray);
+// MIS weight of a strategy with the given pdf against another one.
+static float powerHeuristic(float pdf, float otherPdf) {
+    if (pdf == 0) {
+        return 0;
+    }
+    return pdf * pdf / (pdf * pdf + otherPdf * otherPdf);
+}
 
-    if (!intersectionResult.has_value())
-        return bgColor;
+float Scene::emissionWeight(int figure, const Point &d, const Intersection &hit, const DiffuseVertex &from) const {
+    int light = lights.lightOf(figure);
+    if (light < 0) {
+        return 1;
+    }
+    // Light sampling could only have produced this direction by picking this
+    // light, as anything it passes behind is hidden.
+    float lightPdf = lights.pmf(light, from.origin, from.normal) * lights.pdfHit(light, from.origin, d, hit);
+    return powerHeuristic(from.pdf, lightPdf);
+}
 
-    auto [intersection, intersectedObjectIndex] = intersectionResult.value();
+bool Scene::scatterSpecular(const MaterialData &object, const Intersection &hit, Sampler &sampler, Ray &ray,
+                            Color &throughput) const {
+    auto normal = hit.norma;
+    Point p = ray.o + hit.t * ray.d;
+    Point reflectionDirection = ray.d.normalize() - 2.f * (normal * ray.d.normalize()) * normal;
+    Ray reflectionRay(p + 0.0001f * reflectionDirection, reflectionDirection);
 
-    auto normal = intersection.norma;
-    auto point = intersection.t;
-    auto insideObject = intersection.is_inside;
-    auto intersectedObject = figures[intersectedObjectIndex];
+    if (object.type == Material::METALLIC) {
+        if (isBlack(object.color)) {
+            return false;
+        }
+        throughput = throughput * object.color;
+        ray = reflectionRay;
+        return true;
+    }
 
-    if (intersectedObject.material == Material::METALLIC || intersectedObject.material == Material::DIELECTRIC) {
-        Point reflectionDirection = ray.d.normalize() - 2.0 * (normal * ray.d.normalize()) * normal;
-        Ray reflectionRay(ray.o + point * ray.d + 0.0001 * reflectionDirection, reflectionDirection);
-        Color reflectedColor = getPixelColor(u01, n01, rng, reflectionRay, bounceNum - 1);
+    float eta1 = 1, eta2 = object.ior;
+    if (hit.is_inside)
+        std::swap(eta1, eta2);
 
-        if (intersectedObject.material == Material::DIELECTRIC) {
-            float eta1 = 1.0, eta2 = intersectedObject.ior;
-            if (insideObject)
-                std::swap(eta1, eta2);
+    Point incidentDirection = -1.f * ray.d.normalize();
+    float cosIncident = normal * incidentDirection;
+    float sinTheta = eta1 / eta2 * std::sqrt(1 - cosIncident * cosIncident);
 
-            Point incidentDirection = -1.0 * ray.d.normalize();
-            float sinTheta = eta1 / eta2 * sqrt(1.0 - (normal * incidentDirection) * (normal * incidentDirection));
+    // Schlick's approximation of the Fresnel reflectance.
+    float reflectivityCoefficient = (eta1 - eta2) / (eta1 + eta2) * ((eta1 - eta2) / (eta1 + eta2));
+    float m = 1 - cosIncident;
+    float reflectivity = reflectivityCoefficient + (1 - reflectivityCoefficient) * (m * m) * (m * m) * m;
 
-            if (fabsf(sinTheta) > 1.0) {
-                return intersectedObject.emission + reflectedColor;
-            }
+    if (std::fabs(sinTheta) > 1 || sampler.get1D() < reflectivity) {
+        ray = reflectionRay;
+        return true;
+    }
+    if (!hit.is_inside) {
+        if (isBlack(object.color)) {
+            return false;
+        }
+        throughput = throughput * object.color;
+    }
 
-            float reflectivityCoefficient = pow((eta1 - eta2) / (eta1 + eta2), 2.0);
-            float reflectivity = reflectivityCoefficient + (1.0 - reflectivityCoefficient) * pow(1.0 - (normal * incidentDirection), 5.0);
+    float cosTheta = std::sqrt(1 - sinTheta * sinTheta);
+    Point refractionDirection = eta1 / eta2 * (-1.f * incidentDirection) + (eta1 / eta2 * cosIncident - cosTheta) * normal;
+    ray = Ray(p + 0.0001f * refractionDirection, refractionDirection);
+    return true;
+}
 
-            if (u01(rnd) < reflectivity) {
-                return intersectedObject.emission + reflectedColor;
-            }
+std::optional<LightSample> Scene::sampleNextEvent(Sampler &sampler, int bounceNum, const Point &origin,
+                                                  const Point &normal) const {
+    // The light is the next path vertex, so the last bounce has none.
+    if (lights.isEmpty() || bounceNum + 1 >= rayDepth) {
+        return std::nullopt;
+    }
+    auto lightSample = lights.sampleLight(sampler, origin, normal);
+    if (!lightSample.has_value() || lightSample.value().direction * normal <= 0) {
+        return std::nullopt;
+    }
+    return lightSample;
+}
 
-            float cosTheta = sqrt(1.0 - sinTheta * sinTheta);
-            reflectionDirection = eta1 / eta2 * (-1.0 * incidentDirection) + (eta1 / eta2 * (normal * incidentDirection) - cosTheta) * normal;
-            auto reflection = Ray(ray.o + point * ray.d + 0.0001 * reflectionDirection, reflectionDirection);
-            reflectedColor = getPixelColor(u01, n01, rng, reflection, bounceNum - 1);
+Color Scene::nextEventContribution(const LightSample &sample, const Point &origin, const Point &normal,
+                                   const Color &albedo) const {
+    // The BRDF is color / PI, so a light sample brings albedo * cos / (PI * pdf)
+    // of the emission of the sampled light.
+    auto [l, distance, pdf, light, pmf] = sample;
+    float lightPdf = pmf * pdf;
+    if (lightPdf <= 0) {
+        return {0, 0, 0};
+    }
+    const Color &emission = materialOf(lights.figureOf(light)).emission;
+    float weight = powerHeuristic(lightPdf, diffuse.pdf(origin, normal, l));
+    return (weight * (l * normal) / (PI * lightPdf)) * (albedo * emission);
+}
+
+bool Scene::survivesRoulette(int bounceNum, Sampler &sampler, Color &throughput) {
+    // Low-throughput paths continue only with probability equal to their
+    // largest channel, and the survivors are reweighted.
+    if (bounceNum + 1 >= ROULETTE_DEPTH) {
+        float survival = std::min(1.f, std::max(throughput.r, std::max(throughput.g, throughput.b)));
+        if (sampler.get1D() >= survival) {
+            return false;
+        }
+        throughput = (1.f / survival) * throughput;
+    }
+    return true;
+}
 
-            if (!insideObject) {
-                reflectedColor = reflectedColor * intersectedObject.color;
+Color Scene::getPixelColor(Sampler &sampler, Ray ray, SurfaceAOV *aov) const {
+    Color result{0, 0, 0};
+    // Product of all surface weights along the path so far.
+    Color throughput{1, 1, 1};
+    // Set when the ray was sampled from a diffuse surface, so emission it hits
+    // competes with next-event estimation there.
+    std::optional<DiffuseVertex> lastDiffuse;
+
+    for (int bounceNum = 0; bounceNum < rayDepth; bounceNum++) {
+        // Bounce 0 of the sampler belongs to the camera ray.
+        sampler.setBounce(bounceNum + 1);
+        auto intersectionResult = findIntersection(ray);
+
+        if (!intersectionResult.has_value()) {
+            result = result + throughput * bgColor;
+            if (aov != nullptr && bounceNum == 0) {
+                aov->emission = bgColor;
             }
+            break;
+        }
+
+        auto [intersection, intersectedObjectIndex] = intersectionResult.value();
 
-            return intersectedObject.emission + reflectedColor;
+        auto normal = intersection.norma;
+        auto point = intersection.t;
+        const MaterialData &intersectedObject = materialOf(intersectedObjectIndex);
+
+        if (aov != nullptr && bounceNum == 0) {
+            aov->depth = point * std::sqrt(ray.d.len_square());
+            aov->emission = intersectedObject.emission;
         }
 
-        auto rec_color = intersectedObject.color * reflectedColor;
-        return intersectedObject.emission + rec_color;
-    } else {
-        Point p = ray.o + point * ray.d;
+        if (!isBlack(intersectedObject.emission)) {
+            float weight = lastDiffuse.has_value()
+                           ? emissionWeight(intersectedObjectIndex, ray.d, intersection, lastDiffuse.value()) : 1;
+            result = result + weight * (throughput * intersectedObject.emission);
+        }
+        lastDiffuse.reset();
 
-        Point w = distribution.sample(u01, n01, rng, p + 0.0001 * normal, normal);
-        if (w * normal < 0) {
-            return intersectedObject.emission;
+        if (intersectedObject.type == Material::METALLIC || intersectedObject.type == Material::DIELECTRIC) {
+            if (!scatterSpecular(intersectedObject, intersection, sampler, ray, throughput)) {
+                break;
+            }
+        } else {
+            // Through mirrors and glass the AOVs show the first diffuse surface.
+            if (aov != nullptr) {
+                aov->albedo = throughput * intersectedObject.color;
+                aov->normal = normal;
+                aov = nullptr;
+            }
+            if (isBlack(intersectedObject.color)) {
+                break;
+            }
+
+            Point origin = ray.o + point * ray.d + 0.0001f * normal;
+            Color albedo = throughput * intersectedObject.color;
+
+            auto lightSample = sampleNextEvent(sampler, bounceNum, origin, normal);
+            if (lightSample.has_value()) {
+                const LightSample &sample = lightSample.value();
+                if (!occluded(Ray(origin, sample.direction), SHADOW_FRACTION * sample.distance)) {
+                    result = result + nextEventContribution(sample, origin, normal, albedo);
+                }
+            }
+
+            // The continuation is cosine sampled, which cancels the cosine and
+            // the PI of the BRDF.
+            Point w = diffuse.sample(sampler, origin, normal);
+            if (w * normal < 0) {
+                break;
+            }
+
+            throughput = albedo;
+            lastDiffuse = DiffuseVertex{origin, normal, diffuse.pdf(origin, normal, w)};
+            ray = Ray(origin, w);
         }
 
-        float pdf = distribution.pdf(p + 0.0001 * normal, normal, w);
-        Ray wR = Ray(p + 0.0001 * w, w);
+        if (!survivesRoulette(bounceNum, sampler, throughput)) {
+            break;
+        }
+    }
+    return result;
+}
 
-        auto rec_color = 1.0 / (PI * pdf) * (w * normal) * intersectedObject.color * getPixelColor(u01, n01, rng, wR, bounceNum - 1);
-        return intersectedObject.emission + rec_color;
+// Writes a little-endian PFM with the given number of channels, which stores
+// rows from the bottom up.
+template <typename F>
+static void writePfm(const std::string &path, const Film &film, int channels, F pixel) {
+    std::ofstream out(path, std::ios::binary);
+    out << (channels == 3 ? "PF" : "Pf") << '\n' << film.width << " " << film.height << '\n' << "-1.0" << '\n';
+    for (int y = film.height - 1; y >= 0; y--) {
+        for (int x = 0; x < film.width; x++) {
+            auto values = pixel(y * film.width + x);
+            out.write(reinterpret_cast<const char *>(values.data()), channels * sizeof(float));
+        }
     }
 }
 
-void Scene::render(std::ostream &out) const {
-    out << "P6\n";
-    out << width << " " << height << '\n';
-    out << 255 << '\n';
+Ray Scene::cameraRay(Sampler &pixelSampler, int x, int y) const {
+    auto [jitterX, jitterY] = pixelSampler.get2D();
+    float nx = x + jitterX;
+    float ny = y + jitterY;
 
-    std::uniform_real_distribution<float> u01(0.0, 1.0);
-    std::normal_distribution<float> n01(0.0, 1.0);
+    float tan_x = std::tan(cameraFovX / 2);
+    float tan_y = tan_x * float(height) / float(width);
 
-    std::array<char, 3> ans[height][width];
+    float cx = 2 * nx / width - 1;
+    float cy = 2 * ny / height - 1;
 
-#pragma omp parallel for schedule(dynamic,8)
-    for (int iter = 0; iter < width * height; iter++) {
-        int y = iter / width;
-        int x = iter % width;
+    float real_x = tan_x * cx;
+    float real_y = tan_y * cy;
 
-        rng_type rng(iter);
+    return Ray(camPos, real_x * camRight - real_y * camUp + camForward);
+}
 
-        Color pixel{0, 0, 0};
+Color Scene::samplePixel(int x, int y, int sample, SurfaceAOV &aov) const {
+    Sampler pixelSampler(sampler, y * width + x, sample);
+    Ray ray = cameraRay(pixelSampler, x, y);
+    return getPixelColor(pixelSampler, ray, &aov);
+}
 
-        for (int i = 0; i < samples; i++) {
-            float nx = x + u01(rnd);
-            float ny = y + u01(rnd);
+void Scene::render(std::ostream &out) const {
+    Film film(width, height);
+    film.fingerprint = fingerprint;
+    if (!checkpointPath.empty() && film.load(checkpointPath)) {
+        std::cerr << "Resuming from checkpoint: " << checkpointPath << std::endl;
+    }
+    auto lastCheckpoint = std::chrono::steady_clock::now();
+    std::optional<Wavefront> wavefrontRenderer;
+    if (wavefront) {
+        wavefrontRenderer.emplace(*this, wavefrontBatch);
+    }
 
-            float tan_x = std::tan(cameraFovX / 2);
-            float tan_y = tan_x * float(height) / float(width);
+    int tilesX = (width + ADAPTIVE_TILE - 1) / ADAPTIVE_TILE;
+    int tilesY = (height + ADAPTIVE_TILE - 1) / ADAPTIVE_TILE;
+    std::vector<int> active(tilesX * tilesY);
+    for (int i = 0; i < tilesX * tilesY; i++) {
+        active[i] = i;
+    }
 
-            float cx = 2.0 * nx / width - 1.0;
-            float cy = 2.0 * ny / height - 1.0;
+    // Without a threshold every pixel takes all samples in one round. Otherwise
+    // rounds double the sample count (keeping Sobol prefixes at powers of two)
+    // and tiles whose relative error dropped below the threshold leave. The error
+    // is pooled over a tile because a single pixel that has not met a rare path
+    // yet looks perfectly converged.
+    // Pixels continue from the samples they already have, so a resumed render
+    // only skips through the rounds it had finished.
+    int done = 0;
+    while (!active.empty() && done < samples) {
+        int target = adaptiveThreshold <= 0 ? samples : std::min(samples, done == 0 ? adaptiveMinSamples : 2 * done);
+
+        // With checkpoints enabled, a round is split into passes of one sample
+        // per pixel, after each of which the film may be saved.
+        int pass = checkpointPath.empty() ? target : 1;
+        for (int passEnd = std::min(target, done + pass); done < target; done = passEnd, passEnd += pass) {
+            passEnd = std::min(passEnd, target);
+
+            if (wavefrontRenderer.has_value()) {
+                std::vector<int> pixels;
+                for (int tile : active) {
+                    int tileX = tile % tilesX * ADAPTIVE_TILE;
+                    int tileY = tile / tilesX * ADAPTIVE_TILE;
+                    for (int y = tileY; y < std::min(height, tileY + ADAPTIVE_TILE); y++) {
+                        for (int x = tileX; x < std::min(width, tileX + ADAPTIVE_TILE); x++) {
+                            pixels.push_back(y * width + x);
+                        }
+                    }
+                }
+                wavefrontRenderer->render(film, pixels, passEnd);
+            } else {
+                // Every thread renders a tile into its own small film and publishes
+                // it when done, so threads never write next to each other while
+                // sampling.
+                TileScheduler scheduler(active, tilesX, tilesY, omp_get_max_threads());
+#pragma omp parallel
+                {
+                    Film local(ADAPTIVE_TILE, ADAPTIVE_TILE);
+                    int tile;
+                    while (scheduler.next(omp_get_thread_num(), tile)) {
+                        int tileX = tile % tilesX * ADAPTIVE_TILE;
+                        int tileY = tile / tilesX * ADAPTIVE_TILE;
+                        int tileWidth = std::min(ADAPTIVE_TILE, width - tileX);
+                        int tileHeight = std::min(ADAPTIVE_TILE, height - tileY);
+                        local.copyRect(film, tileX, tileY, 0, 0, tileWidth, tileHeight);
+
+                        for (int y = 0; y < tileHeight; y++) {
+                            for (int x = 0; x < tileWidth; x++) {
+                                int iter = y * ADAPTIVE_TILE + x;
+                                for (int i = local.count[iter]; i < passEnd; i++) {
+                                    SurfaceAOV aov;
+                                    Color color = samplePixel(tileX + x, tileY + y, i, aov);
+                                    local.add(iter, color, aov);
+                                }
+                            }
+                        }
+                        film.copyRect(local, 0, 0, tileX, tileY, tileWidth, tileHeight);
+                    }
+                }
+            }
 
-            float real_x = tan_x * cx;
-            float real_y = tan_y * cy;
+            auto now = std::chrono::steady_clock::now();
+            if (!checkpointPath.empty() && now - lastCheckpoint >= std::chrono::duration<float>(checkpointInterval)) {
+                film.save(checkpointPath);
+                lastCheckpoint = now;
+            }
+        }
 
-            Ray real_ray = Ray(camPos, real_x * camRight - real_y * camUp + camForward);
+        if (adaptiveThreshold > 0 && done > 1 && done < samples) {
+            active.erase(std::remove_if(active.begin(), active.end(), [&](int tile) {
+                int tileX = tile % tilesX * ADAPTIVE_TILE;
+                int tileY = tile / tilesX * ADAPTIVE_TILE;
+                float tileMean = 0, tileVariance = 0;
+                int pixels = 0;
+                for (int y = tileY; y < std::min(height, tileY + ADAPTIVE_TILE); y++) {
+                    for (int x = tileX; x < std::min(width, tileX + ADAPTIVE_TILE); x++) {
+                        int iter = y * width + x;
+                        tileMean += film.mean[iter];
+                        tileVariance += film.meanVariance(iter);
+                        pixels++;
+                    }
+                }
+                float error = std::sqrt(tileVariance / pixels) / std::max(tileMean / pixels, 1e-3f);
+                return error < adaptiveThreshold;
+            }), active.end());
+        }
+    }
 
-            auto from_figures = getPixelColor(u01, n01, rng, real_ray, rayDepth);
+    if (!checkpointPath.empty()) {
+        film.save(checkpointPath);
+    }
 
-            pixel = pixel + from_figures;
+    std::vector<Color> image(width * height);
+    if (denoise) {
+        image = denoiser.denoise(film);
+    } else {
+        for (int iter = 0; iter < width * height; iter++) {
+            image[iter] = film.average(iter);
         }
+    }
 
-        pixel = (1.0 / samples) * pixel;
-
-        pixel = gamma(aces(pixel));
+    out << "P6\n";
+    out << width << " " << height << '\n';
+    out << 255 << '\n';
 
-        ans[y][x] = {char(std::round(255 * pixel.r)), char(std::round(255 * pixel.g)),
-                               char(std::round(255 * pixel.b))};
+    for (int iter = 0; iter < width * height; iter++) {
+        Color pixel = gamma(aces(image[iter]));
+        char rgb[3] = {char(std::round(255 * pixel.r)), char(std::round(255 * pixel.g)),
+                       char(std::round(255 * pixel.b))};
+        out.write(rgb, 3);
     }
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            out.write((char *) ans[y][x].data(), 3);
+    if (!sampleMapPath.empty()) {
+        std::ofstream map(sampleMapPath, std::ios::binary);
+        map << "P5\n" << width << " " << height << '\n' << 255 << '\n';
+        for (int iter = 0; iter < width * height; iter++) {
+            map.put(char(std::round(255.f * std::min<uint32_t>(film.count[iter], samples) / samples)));
         }
     }
+
+    if (!albedoPath.empty()) {
+        writePfm(albedoPath, film, 3, [&](int iter) {
+            Color albedo = film.averageAOV(iter).albedo;
+            return std::array<float, 3>{albedo.r, albedo.g, albedo.b};
+        });
+    }
+    if (!normalPath.empty()) {
+        writePfm(normalPath, film, 3, [&](int iter) {
+            Point normal = film.averageAOV(iter).normal;
+            return std::array<float, 3>{normal.x, normal.y, normal.z};
+        });
+    }
+    if (!depthPath.empty()) {
+        writePfm(depthPath, film, 1, [&](int iter) {
+            return std::array<float, 3>{film.averageAOV(iter).depth, 0, 0};
+        });
+    }
 }
@@ -3,12 +3,24 @@
 
 #include <iostream>
 #include <memory>
+#include <string>
 #include <vector>
 #include "color.h"
 #include "point.h"
 #include "figure.h"
 #include "distribution.h"
 #include "bvh.h"
+#include "mesh.h"
+#include "film.h"
+#include "denoiser.h"
+#include "storage.h"
+
+// A diffuse path vertex the next ray was sampled from, with the pdf of that
+// direction.
+struct DiffuseVertex {
+    Point origin, normal;
+    float pdf;
+};
 
 class Scene {
 public:
@@ -17,22 +29,99 @@ public:
     Color bgColor;
     Point camPos{}, camRight{}, camUp{}, camForward{};
     std::vector <Figure> figures;
+    // Indexed by Figure::material; only hits that are shaded look into it.
+    std::vector<MaterialData> materials;
+    std::vector<Mesh> meshes;
+    // Everything but the planes, in BVH leaf order.
+    std::vector<Primitive> primitives;
 
     int rayDepth{};
 
     int samples{};
+    SamplerType sampler = SamplerType::SOBOL;
+    // Adaptive sampling stops an ADAPTIVE_TILE x ADAPTIVE_TILE tile once the
+    // RMS over its pixels of the standard error of their mean luminance falls
+    // below this fraction of the tile's mean luminance; 0 disables it and
+    // SAMPLES is then taken everywhere.
+    // These tiles are also the unit of work handed to the render threads.
+    float adaptiveThreshold = 0;
+    int adaptiveMinSamples = 16;
+    static constexpr int ADAPTIVE_TILE = 8;
+    // Sample triangle lights by the solid angle they subtend instead of by area.
+    bool sphericalTriangleLights = true;
+    // If set, the number of samples each pixel took is written there as a PGM.
+    std::string sampleMapPath;
+    // If set, the film is saved there every checkpointInterval seconds and at
+    // the end, and a render starts from the film found there. SAMPLES may be
+    // raised between runs; pixels keep the samples they already have.
+    std::string checkpointPath;
+    float checkpointInterval = 60;
+    // Hash of the scene file and sampler settings, stored in checkpoints so
+    // that one taken of another scene is not resumed. Commands such as SAMPLES
+    // and the output paths are left out of it.
+    uint64_t fingerprint = 0;
+    // DENOISE [iterations] filters the image before tone mapping.
+    bool denoise = false;
+    Denoiser denoiser;
+    // WAVEFRONT [batch] traces batches of that many paths breadth-first.
+    bool wavefront = false;
+    int wavefrontBatch = 1 << 16;
+    // If set, the averaged AOVs are written there as PFM images.
+    std::string albedoPath, normalPath, depthPath;
 
     Scene() = default;
 
     void render(std::ostream &out) const;
-    Color getPixelColor(std::uniform_real_distribution<float> u01, std::normal_distribution<float> n01, rng_type &rng, Ray ray, int bounceNum) const;
+    Color samplePixel(int x, int y, int sample, SurfaceAOV &aov) const;
+    // Paths that reached this many bounces are continued by Russian roulette.
+    static constexpr int ROULETTE_DEPTH = 3;
+    // Shadow rays stop at this fraction of the distance to the sampled point,
+    // which keeps the light itself out of the occlusion test.
+    static constexpr float SHADOW_FRACTION = 0.999f;
+
+    // The jittered camera ray through pixel (x, y); takes bounce 0 of the sampler.
+    Ray cameraRay(Sampler &pixelSampler, int x, int y) const;
+    // Fills aov, if given, with what the path saw first.
+    Color getPixelColor(Sampler &sampler, Ray ray, SurfaceAOV *aov = nullptr) const;
+
+    const MaterialData &materialOf(int figure) const { return materials[figures[figure].material]; }
+
+    // The steps of a path, shared by getPixelColor and the wavefront renderer.
+    // MIS weight of emission found along direction d from a diffuse vertex.
+    float emissionWeight(int figure, const Point &d, const Intersection &hit, const DiffuseVertex &from) const;
+    // Reflects or refracts the ray at a metallic or dielectric hit and updates
+    // the throughput. Returns false if the path ends there.
+    bool scatterSpecular(const MaterialData &object, const Intersection &hit, Sampler &sampler, Ray &ray,
+                         Color &throughput) const;
+    // Picks a light to connect to from a diffuse vertex, if it is worth a ray.
+    std::optional<LightSample> sampleNextEvent(Sampler &sampler, int bounceNum, const Point &origin,
+                                               const Point &normal) const;
+    // What the light sample brings if nothing occludes it.
+    Color nextEventContribution(const LightSample &sample, const Point &origin, const Point &normal,
+                                const Color &albedo) const;
+    // Russian roulette past ROULETTE_DEPTH. Returns false if the path ends.
+    static bool survivesRoulette(int bounceNum, Sampler &sampler, Color &throughput);
 
-    Mix distribution;
+    Cosine diffuse;
+    // Emitters sampled by next-event estimation at diffuse hits.
+    FiguresMix lights;
 
     BVH bvh;
     int bvhble;
+    int bvhWidth = 8;
+    // PRIMITIVE_ARRAYS ON makes the BVH leaves test their primitives through
+    // the per-kind blocks of storage. That pays off for meshes, whose leaves
+    // fill the blocks, but not for scattered solids alone in their leaves.
+    bool primitiveArrays = false;
+    PrimitiveStorage storage;
 
+    std::optional<Intersection> intersectPrimitive(uint32_t i, const Ray &ray, bool require_normal = true) const;
+    // The full intersection of a hit on primitive i found without its normal.
+    Intersection computeSurface(uint32_t i, const Ray &ray, const Intersection &hit) const;
+    // Returns the hit and the index of the hit figure.
     std::optional<std::pair<Intersection, int>> findIntersection(Ray ray) const;
+    // Any-hit query: whether something is hit closer than tMax along the ray.
+    bool occluded(const Ray &ray, float tMax) const;
 };
 
 Scene loadSceneFromFile(std::istream &in);
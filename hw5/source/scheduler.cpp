@@ -0,0 +1,64 @@
+#include "scheduler.h"
+#include <algorithm>
+#include <cstdint>
+
+// Position of (x, y) along the Hilbert curve filling an n x n grid, n being a
+// power of two.
+static uint64_t hilbertIndex(uint32_t n, uint32_t x, uint32_t y) {
+    uint64_t index = 0;
+    for (uint32_t s = n / 2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) > 0, ry = (y & s) > 0;
+        index += uint64_t(s) * s * ((3 * rx) ^ ry);
+        // Rotate the quadrant so that the curve inside it starts where the
+        // previous one ended.
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return index;
+}
+
+TileScheduler::TileScheduler(std::vector<int> tiles, int tilesX, int tilesY, int workers): workers(workers),
+                                                                                            queues(new Queue[workers]) {
+    uint32_t n = 1;
+    while (n < uint32_t(std::max(tilesX, tilesY))) {
+        n *= 2;
+    }
+    std::vector<std::pair<uint64_t, int>> order(tiles.size());
+    for (size_t i = 0; i < tiles.size(); i++) {
+        order[i] = {hilbertIndex(n, tiles[i] % tilesX, tiles[i] / tilesX), tiles[i]};
+    }
+    std::sort(order.begin(), order.end());
+
+    for (int worker = 0; worker < workers; worker++) {
+        size_t first = order.size() * worker / workers, last = order.size() * (worker + 1) / workers;
+        for (size_t i = first; i < last; i++) {
+            queues[worker].tiles.push_back(order[i].second);
+        }
+    }
+}
+
+bool TileScheduler::next(int worker, int &tile) {
+    {
+        std::lock_guard<std::mutex> lock(queues[worker].mutex);
+        if (!queues[worker].tiles.empty()) {
+            tile = queues[worker].tiles.front();
+            queues[worker].tiles.pop_front();
+            return true;
+        }
+    }
+    for (int i = 1; i < workers; i++) {
+        Queue &victim = queues[(worker + i) % workers];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tiles.empty()) {
+            tile = victim.tiles.back();
+            victim.tiles.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
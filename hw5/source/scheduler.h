@@ -0,0 +1,30 @@
+#pragma once
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Hands out the tiles of a render pass to a fixed set of workers. Tiles are
+// sorted along a Hilbert curve and every worker starts with a contiguous run
+// of it, so the tiles one thread renders in a row are neighbours on screen and
+// share the geometry they hit. A worker that runs out steals from the far end
+// of another worker's run, away from where its owner is working.
+class TileScheduler {
+public:
+    TileScheduler(std::vector<int> tiles, int tilesX, int tilesY, int workers);
+
+    // Takes the next tile of the worker, or steals one. Returns false once
+    // every tile has been handed out.
+    bool next(int worker, int &tile);
+
+private:
+    // Each queue sits on its own cache line, so locking one does not slow down
+    // the others.
+    struct alignas(64) Queue {
+        std::mutex mutex;
+        std::deque<int> tiles;
+    };
+
+    int workers;
+    std::unique_ptr<Queue[]> queues;
+};
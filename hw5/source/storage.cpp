@@ -0,0 +1,306 @@
+#include "storage.h"
+#include <algorithm>
+
+static PrimitiveKind kindOf(const Figure &figure) {
+    if (figure.type == FigureType::ELLIPSOID) {
+        return PrimitiveKind::ELLIPSOID;
+    }
+    if (figure.type == FigureType::BOX) {
+        return PrimitiveKind::BOX;
+    }
+    return PrimitiveKind::TRIANGLE;
+}
+
+// The block holding lane index of a leaf whose blocks start at first. Leaves
+// are filled one after another, so a new block is always the next one.
+template <typename Block>
+static Block &blockOf(std::vector<Block> &blocks, uint32_t first, uint32_t index) {
+    uint32_t block = first + index / 8;
+    if (block == blocks.size()) {
+        blocks.emplace_back();
+    }
+    return blocks[block];
+}
+
+static void setSolid(SolidBlock &block, int lane, const Figure &figure) {
+    block.position.set(lane, figure.position);
+    for (int row = 0; row < 3; row++) {
+        block.toLocal[row].set(lane, figure.toLocal.rows[row]);
+    }
+    block.data.set(lane, figure.data);
+    block.inverseData.set(lane, figure.inverseData);
+    block.rotated.v[lane] = figure.rotated ? -1 : 0;
+}
+
+void PrimitiveStorage::build(const std::vector<Figure> &figures, const std::vector<Mesh> &meshes, const BVH &bvh,
+                             const std::vector<Primitive> &primitives) {
+    ellipsoids.clear();
+    boxes.clear();
+    triangles.clear();
+    for (auto &lanes : this->figures) {
+        lanes.clear();
+    }
+    leaves.assign(primitives.size(), {});
+
+    for (const Node &node : bvh.nodes) {
+        if (!node.isLeaf()) {
+            continue;
+        }
+        LeafBlocks &leaf = leaves[node.offset];
+        leaf.first[0] = ellipsoids.size();
+        leaf.first[1] = boxes.size();
+        leaf.first[2] = triangles.size();
+
+        for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+            const Primitive &primitive = primitives[i];
+            const Figure &figure = figures[primitive.figure];
+            int kind = int(kindOf(figure));
+            uint32_t index = leaf.count[kind]++;
+            int lane = index % 8;
+
+            if (kind != int(PrimitiveKind::TRIANGLE)) {
+                auto &blocks = kind == int(PrimitiveKind::ELLIPSOID) ? ellipsoids : boxes;
+                setSolid(blockOf(blocks, leaf.first[kind], index), lane, figure);
+            } else {
+                Point a, b, c;
+                if (figure.type == FigureType::MESH) {
+                    const Mesh &mesh = meshes[figure.mesh];
+                    a = mesh.vertex(primitive.triangle, 0);
+                    b = mesh.vertex(primitive.triangle, 2) - a;
+                    c = mesh.vertex(primitive.triangle, 1) - a;
+                } else if (figure.rotated) {
+                    a = figure.toLocal.transformTransposed(figure.data3) + figure.position;
+                    b = figure.toLocal.transformTransposed(figure.edge1);
+                    c = figure.toLocal.transformTransposed(figure.edge2);
+                } else {
+                    a = figure.data3 + figure.position;
+                    b = figure.edge1;
+                    c = figure.edge2;
+                }
+                TriangleBlock &block = blockOf(triangles, leaf.first[kind], index);
+                block.a.set(lane, a);
+                block.b.set(lane, b);
+                block.c.set(lane, c);
+            }
+
+            auto &lanes = this->figures[kind];
+            lanes.resize(std::max<size_t>(lanes.size(), 8 * (leaf.first[kind] + index / 8 + 1)));
+            lanes[8 * leaf.first[kind] + index] = primitive.figure;
+        }
+    }
+    avx2 = cpuSupportsAvx2();
+}
+
+// The kernels and the loops over a leaf are forced inline, so that the
+// Float8 arithmetic is compiled along with the AVX2 entry points below.
+#define STORAGE_INLINE inline __attribute__((always_inline))
+
+// The ray in the frames of the eight solids. Solids that are not rotated are
+// only shifted, exactly as in Figure::intersect.
+STORAGE_INLINE Ray8 toLocal(const SolidBlock &solids, const Ray &ray) {
+    Point8 o = Point8(ray.o) - solids.position;
+    Point8 d(ray.d);
+    const Point8 *rows = solids.toLocal;
+    const Mask8 &rotated = solids.rotated;
+
+    Ray8 local;
+    if (!rotated.any()) {
+        local.o = o;
+        local.d = d;
+        return local;
+    }
+    local.o = {select(rotated, rows[0] * o, o.x), select(rotated, rows[1] * o, o.y),
+               select(rotated, rows[2] * o, o.z)};
+    local.d = {select(rotated, rows[0] * d, d.x), select(rotated, rows[1] * d, d.y),
+               select(rotated, rows[2] * d, d.z)};
+    return local;
+}
+
+// Figure::intersectAsEllipsoid for eight ellipsoids. Lanes where the ray
+// starts inside are set in inside.
+STORAGE_INLINE Mask8 intersectEllipsoids(const SolidBlock &solids, const Ray &ray, Float8 &t, Mask8 &inside) {
+    Ray8 local = toLocal(solids, ray);
+    Point8 ro = local.o ^ solids.inverseData;
+    Point8 rd = local.d ^ solids.inverseData;
+    Float8 c = ro.len_square() - Float8(1);
+    Float8 b = Float8(2) * (ro * rd);
+    Float8 a = rd.len_square();
+
+    Float8 d = b * b - Float8(4) * a * c;
+    Float8 root = sqrt(d);
+    Float8 x1 = (Float8(0) - b - root) / (Float8(2) * a);
+    Float8 x2 = (Float8(0) - b + root) / (Float8(2) * a);
+    Mask8 swapped = x1 > x2;
+    Float8 near = select(swapped, x2, x1), far = select(swapped, x1, x2);
+    inside = near < Float8(0);
+    t = select(inside, far, near);
+    return (d > Float8(0)) & (far >= Float8(0));
+}
+
+// intersectBoxAndRay for eight boxes. The minimums and maximums are taken as
+// std::min and std::max take them.
+STORAGE_INLINE Mask8 intersectBoxes(const SolidBlock &solids, const Ray &ray, Float8 &t, Mask8 &inside) {
+    Ray8 local = toLocal(solids, ray);
+    Point8 lower = Float8(-1) * solids.data - local.o;
+    Point8 upper = solids.data - local.o;
+
+    Float8 starts[3] = {lower.x, lower.y, lower.z}, ends[3] = {upper.x, upper.y, upper.z};
+    Float8 directions[3] = {local.d.x, local.d.y, local.d.z};
+    Float8 near[3], far[3];
+    for (int axis = 0; axis < 3; axis++) {
+        Float8 invDir = Float8(1) / directions[axis];
+        Float8 start = starts[axis] * invDir, end = ends[axis] * invDir;
+        Mask8 swapped = start > end;
+        near[axis] = select(swapped, end, start);
+        far[axis] = select(swapped, start, end);
+    }
+    auto stdMax = [](const Float8 &a, const Float8 &b) { return select(a < b, b, a); };
+    auto stdMin = [](const Float8 &a, const Float8 &b) { return select(b < a, b, a); };
+    Float8 t1 = stdMax(near[0], stdMax(near[1], near[2]));
+    Float8 t2 = stdMin(far[0], stdMin(far[1], far[2]));
+    inside = t1 < Float8(0);
+    t = select(inside, t2, t1);
+    return (t1 <= t2) & (t2 >= Float8(0));
+}
+
+// intersectTriangleAndRay for eight triangles.
+STORAGE_INLINE Mask8 intersectTriangles(const TriangleBlock &triangles, const Ray &ray, Float8 &t) {
+    const Point8 &b = triangles.b, &c = triangles.c;
+    Point8 n = b.inter(c);
+    Point8 o = Point8(ray.o) - triangles.a, d(ray.d);
+    t = (Float8(0) - o * n) / (d * n);
+    Point8 p = o + t * d;
+    Mask8 hit = (t > Float8(0)) & (t < Float8(1e4f));
+    hit = hit & (b.inter(p) * n >= Float8(0));
+    hit = hit & (p.inter(c) * n >= Float8(0));
+    hit = hit & ((c - b).inter(p - b) * n >= Float8(0));
+    return hit;
+}
+
+// The kernel of one kind for block i of its blocks. The side of a triangle
+// is left to computeSurface(), which finds it from the ray.
+template <PrimitiveKind Kind>
+STORAGE_INLINE Mask8 intersectKind(const PrimitiveStorage &storage, uint32_t i, const Ray &ray, Float8 &t,
+                                   Mask8 &inside) {
+    if constexpr (Kind == PrimitiveKind::ELLIPSOID) {
+        return intersectEllipsoids(storage.ellipsoids[i], ray, t, inside);
+    } else if constexpr (Kind == PrimitiveKind::BOX) {
+        return intersectBoxes(storage.boxes[i], ray, t, inside);
+    } else {
+        inside = Mask8{IntLanes{}};
+        return intersectTriangles(storage.triangles[i], ray, t);
+    }
+}
+
+// Tests the primitives of one kind in the leaf eight at a time and calls
+// found(index, t, inside) in order for every one hit closer than best.
+template <PrimitiveKind Kind, typename Found>
+STORAGE_INLINE void forHits(const PrimitiveStorage &storage, const LeafBlocks &leaf, const Ray &ray,
+                            const float &best, Found &&found) {
+    uint32_t count = leaf.count[int(Kind)];
+    for (uint32_t done = 0; done < count; done += 8) {
+        uint32_t block = leaf.first[int(Kind)] + done / 8;
+        Float8 t;
+        Mask8 inside;
+        Mask8 hit = intersectKind<Kind>(storage, block, ray, t, inside);
+        int lanes = hit.bits() & (t < Float8(best)).bits();
+        if (count - done < 8) {
+            lanes &= (1 << (count - done)) - 1;
+        }
+        for (int lane = 0; lanes != 0; lane++, lanes >>= 1) {
+            if ((lanes & 1) && t[lane] < best) {
+                found(8 * block + lane, t[lane], inside.v[lane] != 0);
+            }
+        }
+    }
+}
+
+STORAGE_INLINE void closestInLeaf(const PrimitiveStorage &storage, uint32_t first, const Ray &ray, float &best,
+                                  std::optional<StoredHit> &hit) {
+    const LeafBlocks &leaf = storage.leaves[first];
+    forHits<PrimitiveKind::ELLIPSOID>(storage, leaf, ray, best,
+                                      [&](uint32_t index, float t, bool inside) __attribute__((always_inline)) {
+        best = t;
+        hit = StoredHit{PrimitiveKind::ELLIPSOID, index, inside};
+    });
+    forHits<PrimitiveKind::BOX>(storage, leaf, ray, best,
+                                [&](uint32_t index, float t, bool inside) __attribute__((always_inline)) {
+        best = t;
+        hit = StoredHit{PrimitiveKind::BOX, index, inside};
+    });
+    forHits<PrimitiveKind::TRIANGLE>(storage, leaf, ray, best,
+                                     [&](uint32_t index, float t, bool inside) __attribute__((always_inline)) {
+        best = t;
+        hit = StoredHit{PrimitiveKind::TRIANGLE, index, inside};
+    });
+}
+
+STORAGE_INLINE bool occludesInLeaf(const PrimitiveStorage &storage, uint32_t first, const Ray &ray, float tMax) {
+    const LeafBlocks &leaf = storage.leaves[first];
+    bool hit = false;
+    auto found = [&](uint32_t, float, bool) __attribute__((always_inline)) {
+        hit = true;
+    };
+    forHits<PrimitiveKind::ELLIPSOID>(storage, leaf, ray, tMax, found);
+    if (!hit) {
+        forHits<PrimitiveKind::BOX>(storage, leaf, ray, tMax, found);
+    }
+    if (!hit) {
+        forHits<PrimitiveKind::TRIANGLE>(storage, leaf, ray, tMax, found);
+    }
+    return hit;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+static void closestAvx2(const PrimitiveStorage &storage, uint32_t first, const Ray &ray, float &best,
+                        std::optional<StoredHit> &hit) {
+    closestInLeaf(storage, first, ray, best, hit);
+}
+
+__attribute__((target("avx2")))
+static bool occludesAvx2(const PrimitiveStorage &storage, uint32_t first, const Ray &ray, float tMax) {
+    return occludesInLeaf(storage, first, ray, tMax);
+}
+
+#endif
+
+void PrimitiveStorage::closest(uint32_t first, const Ray &ray, float &best, std::optional<StoredHit> &hit) const {
+#if defined(__x86_64__) || defined(__i386__)
+    if (avx2) {
+        closestAvx2(*this, first, ray, best, hit);
+        return;
+    }
+#endif
+    closestInLeaf(*this, first, ray, best, hit);
+}
+
+bool PrimitiveStorage::occludes(uint32_t first, const Ray &ray, float tMax) const {
+#if defined(__x86_64__) || defined(__i386__)
+    if (avx2) {
+        return occludesAvx2(*this, first, ray, tMax);
+    }
+#endif
+    return occludesInLeaf(*this, first, ray, tMax);
+}
+
+std::pair<Intersection, int> PrimitiveStorage::computeSurface(const StoredHit &hit, const Ray &ray, float t,
+                                                             const std::vector<Figure> &figures) const {
+    int figure = this->figures[int(hit.kind)][hit.index];
+    if (hit.kind != PrimitiveKind::TRIANGLE) {
+        // The kernels repeat the scalar arithmetic of solids, so the figure
+        // completes the hit as it would complete its own.
+        return {figures[figure].computeSurface(ray, {t, {}, hit.inside}), figure};
+    }
+
+    // As intersectPlaneAndRay turns the normal of a triangle towards the ray.
+    const TriangleBlock &block = triangles[hit.index / 8];
+    int lane = hit.index % 8;
+    Point n = block.b.get(lane).inter(block.c.get(lane));
+    bool inside = ray.d * n > 0;
+    if (inside) {
+        n = -1.f * n;
+    }
+    return {Intersection{t, n.normalize(), inside}, figure};
+}
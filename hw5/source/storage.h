@@ -0,0 +1,90 @@
+#pragma once
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+#include "figure.h"
+#include "mesh.h"
+#include "bvh.h"
+#include "vecmath.h"
+
+// What a BVH leaf refers to: a whole figure, or one triangle of a MESH figure.
+struct Primitive {
+    uint32_t figure;
+    uint32_t triangle;
+};
+
+// Primitives that share one intersection kernel. TRIANGLE figures and the
+// triangles of meshes are both TRIANGLE.
+enum class PrimitiveKind {
+    ELLIPSOID, BOX, TRIANGLE
+};
+
+// Eight ellipsoids or boxes in structure-of-arrays form. toLocal holds the
+// rows of their toLocal matrices, and rotated is set for the rotated ones:
+// rays are moved into the frame of every lane as Figure::intersect does it.
+// The matrices come last, as blocks without rotated solids never read them.
+struct SolidBlock {
+    Mask8 rotated;
+    Point8 position;
+    Point8 data, inverseData;
+    Point8 toLocal[3];
+};
+
+// Eight triangles in world space given as intersectTriangleAndRay takes them:
+// a vertex and the edges b and c from it.
+struct TriangleBlock {
+    Point8 a, b, c;
+};
+
+// Where the primitives of one leaf are kept: its lanes of kind k start at
+// block first[k] of that kind and there are count[k] of them.
+struct LeafBlocks {
+    uint32_t first[3];
+    uint32_t count[3];
+};
+
+// The closest primitive found by PrimitiveStorage::closest(): lane index % 8
+// of block index / 8 of its kind, and whether the ray starts inside it.
+struct StoredHit {
+    PrimitiveKind kind;
+    uint32_t index;
+    bool inside;
+};
+
+// The BVH primitives split by kind into blocks of eight, so that a leaf tests
+// its ellipsoids, boxes and triangles eight at a time with the kernel of their
+// kind instead of branching on the type of every figure it holds. The
+// primitives of every leaf start a new block of each kind, so a leaf reads a
+// few whole blocks in a row, found by one lookup in leaves.
+class PrimitiveStorage {
+public:
+    static constexpr int KINDS = 3;
+    // The kernels test this many primitives for the price of one, which the
+    // BVH build is told.
+    static constexpr uint32_t BATCH = 8;
+
+    std::vector<SolidBlock> ellipsoids, boxes;
+    std::vector<TriangleBlock> triangles;
+    // The figure of every lane of every kind.
+    std::vector<uint32_t> figures[KINDS];
+    // Indexed by the offset of a leaf into the primitives.
+    std::vector<LeafBlocks> leaves;
+
+    // Fills the blocks from the leaves of the BVH, whose ranges index into
+    // primitives. Mesh vertices must already be in world space.
+    void build(const std::vector<Figure> &figures, const std::vector<Mesh> &meshes, const BVH &bvh,
+               const std::vector<Primitive> &primitives);
+
+    // Lowers best to the closest hit in the leaf at first and sets hit to it.
+    void closest(uint32_t first, const Ray &ray, float &best, std::optional<StoredHit> &hit) const;
+    // Whether a primitive of the leaf at first is hit closer than tMax.
+    bool occludes(uint32_t first, const Ray &ray, float tMax) const;
+    // The full intersection of a hit found by closest() at distance t and the
+    // index of its figure.
+    std::pair<Intersection, int> computeSurface(const StoredHit &hit, const Ray &ray, float t,
+                                                const std::vector<Figure> &figures) const;
+
+private:
+    bool avx2 = false;
+};
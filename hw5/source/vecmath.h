@@ -0,0 +1,187 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include "point.h"
+#include "figure.h"
+
+// Eight-wide packet types in structure-of-arrays form: a Point8 holds the x of
+// eight points in one Float8, then their y and z. The lanes are vectors of the
+// GCC and Clang vector extension, so every operation is one packed instruction,
+// or two SSE ones where the function is not compiled for AVX, instead of a loop
+// the vectorizer may or may not turn into one. Like Point and Color they use
+// floats only; literals must carry the f suffix so nothing is widened to double.
+typedef float FloatLanes __attribute__((vector_size(32)));
+typedef int32_t IntLanes __attribute__((vector_size(32)));
+
+// Per-lane result of a comparison: all bits set where it holds.
+struct alignas(32) Mask8 {
+    IntLanes v;
+
+    // Bit i is set if lane i is.
+    int bits() const;
+    bool any() const;
+};
+
+struct alignas(32) Float8 {
+    FloatLanes v;
+
+    Float8() = default;
+    Float8(float k);
+    explicit Float8(const FloatLanes &v);
+
+    float &operator[](int lane) { return reinterpret_cast<float *>(&v)[lane]; }
+    float operator[](int lane) const { return reinterpret_cast<const float *>(&v)[lane]; }
+};
+
+inline Float8::Float8(float k): v(FloatLanes{} + k) {}
+
+inline Float8::Float8(const FloatLanes &v): v(v) {}
+
+#define FLOAT8_OPERATOR(op)                                          \
+    inline Float8 operator op(const Float8 &a, const Float8 &b) {    \
+        return Float8(a.v op b.v);                                   \
+    }
+
+FLOAT8_OPERATOR(+)
+FLOAT8_OPERATOR(-)
+FLOAT8_OPERATOR(*)
+FLOAT8_OPERATOR(/)
+#undef FLOAT8_OPERATOR
+
+#define FLOAT8_COMPARISON(op)                                        \
+    inline Mask8 operator op(const Float8 &a, const Float8 &b) {     \
+        return {a.v op b.v};                                         \
+    }
+
+FLOAT8_COMPARISON(<)
+FLOAT8_COMPARISON(<=)
+FLOAT8_COMPARISON(>)
+FLOAT8_COMPARISON(>=)
+#undef FLOAT8_COMPARISON
+
+inline Mask8 operator&(const Mask8 &a, const Mask8 &b) {
+    return {a.v & b.v};
+}
+
+inline Mask8 operator|(const Mask8 &a, const Mask8 &b) {
+    return {a.v | b.v};
+}
+
+inline int Mask8::bits() const {
+    int result = 0;
+    for (int i = 0; i < 8; i++) {
+        result |= (v[i] & 1) << i;
+    }
+    return result;
+}
+
+inline bool Mask8::any() const {
+    return bits() != 0;
+}
+
+// a where the mask is set, b elsewhere.
+inline Float8 select(const Mask8 &mask, const Float8 &a, const Float8 &b) {
+    return Float8(FloatLanes((mask.v & IntLanes(a.v)) | (~mask.v & IntLanes(b.v))));
+}
+
+inline Float8 min(const Float8 &a, const Float8 &b) {
+    return select(a < b, a, b);
+}
+
+inline Float8 max(const Float8 &a, const Float8 &b) {
+    return select(a > b, a, b);
+}
+
+inline Float8 sqrt(const Float8 &a) {
+    Float8 result;
+    for (int i = 0; i < 8; i++) {
+        result[i] = std::sqrt(a[i]);
+    }
+    return result;
+}
+
+class Point8 {
+public:
+    Float8 x, y, z;
+
+    Point8() = default;
+    Point8(const Float8 &x, const Float8 &y, const Float8 &z);
+    // The same point in every lane.
+    explicit Point8(const Point &p);
+
+    Point8 operator+ (const Point8 &p) const;
+    Point8 operator- (const Point8 &p) const;
+    Float8 operator* (const Point8 &p) const;
+    Point8 operator^ (const Point8 &p) const;
+    Float8 len_square() const;
+    Point8 inter(const Point8 &p) const;
+
+    Point get(int lane) const;
+    void set(int lane, const Point &p);
+};
+
+Point8 operator* (const Float8 &k, const Point8 &p);
+
+inline Point8::Point8(const Float8 &x, const Float8 &y, const Float8 &z): x(x), y(y), z(z) {}
+
+inline Point8::Point8(const Point &p): x(p.x), y(p.y), z(p.z) {}
+
+inline Point8 Point8::operator+ (const Point8 &p) const {
+    return {x + p.x, y + p.y, z + p.z};
+}
+
+inline Point8 Point8::operator- (const Point8 &p) const {
+    return {x - p.x, y - p.y, z - p.z};
+}
+
+inline Point8 operator* (const Float8 &k, const Point8 &p) {
+    return {k * p.x, k * p.y, k * p.z};
+}
+
+inline Float8 Point8::operator* (const Point8 &p) const {
+    return x * p.x + y * p.y + z * p.z;
+}
+
+inline Point8 Point8::operator^ (const Point8 &p) const {
+    return {x * p.x, y * p.y, z * p.z};
+}
+
+inline Float8 Point8::len_square() const {
+    return (*this) * (*this);
+}
+
+inline Point8 Point8::inter(const Point8 &p) const {
+    return {z * p.y - y * p.z, x * p.z - z * p.x, y * p.x - x * p.y};
+}
+
+inline Point Point8::get(int lane) const {
+    return {x[lane], y[lane], z[lane]};
+}
+
+inline void Point8::set(int lane, const Point &p) {
+    x[lane] = p.x;
+    y[lane] = p.y;
+    z[lane] = p.z;
+}
+
+// Matrix::transform of every lane.
+inline Point8 transform(const Matrix &m, const Point8 &p) {
+    return {Point8(m.rows[0]) * p, Point8(m.rows[1]) * p, Point8(m.rows[2]) * p};
+}
+
+class Ray8 {
+public:
+    Point8 o, d;
+
+    Ray get(int lane) const;
+    void set(int lane, const Ray &ray);
+};
+
+inline Ray Ray8::get(int lane) const {
+    return {o.get(lane), d.get(lane)};
+}
+
+inline void Ray8::set(int lane, const Ray &ray) {
+    o.set(lane, ray.o);
+    d.set(lane, ray.d);
+}
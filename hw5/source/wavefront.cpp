@@ -0,0 +1,297 @@
+#include "wavefront.h"
+#include <algorithm>
+#include <cmath>
+
+static bool isBlack(const Color &c) {
+    return c.r == 0 && c.g == 0 && c.b == 0;
+}
+
+// Spreads the low 4 bits of x so that there are two zero bits between them.
+static uint32_t spreadBits(uint32_t x) {
+    x &= 0xf;
+    x = (x | (x << 4)) & 0x0c3;
+    x = (x | (x << 2)) & 0x249;
+    return x;
+}
+
+Wavefront::RayQueue::RayQueue(int capacity): origin(capacity), direction(capacity), path(capacity) {}
+
+void Wavefront::RayQueue::push(const Point &o, const Point &d, uint32_t pathIndex) {
+    uint32_t slot = size.fetch_add(1, std::memory_order_relaxed);
+    origin[slot] = o;
+    direction[slot] = d;
+    path[slot] = pathIndex;
+}
+
+Wavefront::ShadowQueue::ShadowQueue(int capacity): rays(capacity), normal(capacity), sample(capacity),
+                                                   albedo(capacity) {}
+
+void Wavefront::ShadowQueue::push(const Point &o, const Point &n, const LightSample &lightSample, const Color &color,
+                                  uint32_t pathIndex) {
+    uint32_t slot = rays.size.fetch_add(1, std::memory_order_relaxed);
+    rays.origin[slot] = o;
+    rays.direction[slot] = lightSample.direction;
+    rays.path[slot] = pathIndex;
+    normal[slot] = n;
+    sample[slot] = lightSample;
+    albedo[slot] = color;
+}
+
+Wavefront::Wavefront(const Scene &scene, int batch): scene(scene), batch(batch), pixel(batch), throughput(batch),
+                                                     radiance(batch), aov(batch), recordAOV(batch),
+                                                     afterDiffuse(batch), lastDiffuse(batch), current(batch),
+                                                     next(batch), shadow(batch), hits(batch),
+                                                     offsets(SORT_KEYS + 1) {
+    samplers.reserve(batch);
+}
+
+void Wavefront::render(Film &film, const std::vector<int> &pixels, int passEnd) {
+    std::vector<std::pair<int, int>> work;
+    work.reserve(batch);
+    size_t cursor = 0;
+    int sample = cursor < pixels.size() ? film.count[pixels[cursor]] : 0;
+
+    while (cursor < pixels.size()) {
+        // Pixels and samples in the order getPixelColor would take them, so the
+        // film accumulates them in the same order too.
+        work.clear();
+        while (cursor < pixels.size() && int(work.size()) < batch) {
+            if (sample >= passEnd) {
+                cursor++;
+                sample = cursor < pixels.size() ? film.count[pixels[cursor]] : 0;
+                continue;
+            }
+            work.emplace_back(pixels[cursor], sample++);
+        }
+        if (work.empty()) {
+            break;
+        }
+
+        generate(work);
+        for (int bounceNum = 0; bounceNum < scene.rayDepth && current.size > 0; bounceNum++) {
+            sortRays();
+            extend();
+            classify();
+
+            next.size = 0;
+            shadow.rays.size = 0;
+            shadeMissed(bounceNum);
+            shadeSpecular(metallic, bounceNum);
+            shadeSpecular(dielectric, bounceNum);
+            shadeDiffuse(bounceNum);
+            traceShadows();
+
+            std::swap(current.origin, next.origin);
+            std::swap(current.direction, next.direction);
+            std::swap(current.path, next.path);
+            current.size = next.size.load();
+        }
+
+        for (size_t i = 0; i < work.size(); i++) {
+            film.add(work[i].first, radiance[i], aov[i]);
+        }
+    }
+}
+
+void Wavefront::generate(const std::vector<std::pair<int, int>> &work) {
+    samplers.clear();
+    for (size_t i = 0; i < work.size(); i++) {
+        samplers.emplace_back(scene.sampler, work[i].first, work[i].second);
+    }
+
+    current.size = work.size();
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < work.size(); i++) {
+        pixel[i] = work[i].first;
+        throughput[i] = Color(1, 1, 1);
+        radiance[i] = Color(0, 0, 0);
+        aov[i] = SurfaceAOV();
+        recordAOV[i] = true;
+        afterDiffuse[i] = false;
+
+        Ray ray = scene.cameraRay(samplers[i], pixel[i] % scene.width, pixel[i] / scene.width);
+        current.origin[i] = ray.o;
+        current.direction[i] = ray.d;
+        current.path[i] = i;
+    }
+}
+
+// Orders the queue by direction octant and then by origin along a Morton curve
+// over a 16x16x16 grid, so that neighbouring rays tend to visit the same BVH
+// nodes in the same order. A counting sort on this short key is cheap enough
+// to pay off even when the scene fits in cache, and being stable it keeps the
+// queue order deterministic.
+void Wavefront::sortRays() {
+    uint32_t size = current.size;
+    AABB bounds;
+    for (uint32_t i = 0; i < size; i++) {
+        bounds.extend(current.origin[i]);
+    }
+    Point extent = bounds.max - bounds.min;
+    auto cell = [](float offset, float extent) {
+        return extent > 0 ? std::min(uint32_t(offset / extent * SORT_GRID), SORT_GRID - 1) : 0;
+    };
+
+    keys.resize(size);
+#pragma omp parallel for schedule(static)
+    for (uint32_t i = 0; i < size; i++) {
+        Point o = current.origin[i] - bounds.min;
+        const Point &d = current.direction[i];
+        uint32_t octant = (d.x < 0) | (d.y < 0) << 1 | (d.z < 0) << 2;
+        keys[i] = octant << 12 | spreadBits(cell(o.x, extent.x)) | spreadBits(cell(o.y, extent.y)) << 1 |
+                  spreadBits(cell(o.z, extent.z)) << 2;
+    }
+
+    std::fill(offsets.begin(), offsets.end(), 0);
+    for (uint32_t i = 0; i < size; i++) {
+        offsets[keys[i] + 1]++;
+    }
+    for (uint32_t key = 1; key < SORT_KEYS; key++) {
+        offsets[key] += offsets[key - 1];
+    }
+    // The next queue is empty until shading, so it holds the sorted copy.
+    for (uint32_t i = 0; i < size; i++) {
+        uint32_t slot = offsets[keys[i]]++;
+        next.origin[slot] = current.origin[i];
+        next.direction[slot] = current.direction[i];
+        next.path[slot] = current.path[i];
+    }
+    std::swap(current.origin, next.origin);
+    std::swap(current.direction, next.direction);
+    std::swap(current.path, next.path);
+}
+
+void Wavefront::extend() {
+    int size = current.size;
+#pragma omp parallel for schedule(dynamic, 64)
+    for (int i = 0; i < size; i++) {
+        hits[i] = scene.findIntersection(Ray(current.origin[i], current.direction[i]));
+    }
+}
+
+void Wavefront::classify() {
+    missed.clear();
+    metallic.clear();
+    dielectric.clear();
+    diffuse.clear();
+    for (uint32_t i = 0; i < current.size; i++) {
+        if (!hits[i].has_value()) {
+            missed.push_back(i);
+            continue;
+        }
+        switch (scene.materialOf(hits[i].value().second).type) {
+            case Material::METALLIC:
+                metallic.push_back(i);
+                break;
+            case Material::DIELECTRIC:
+                dielectric.push_back(i);
+                break;
+            default:
+                diffuse.push_back(i);
+        }
+    }
+}
+
+void Wavefront::addEmission(uint32_t ray, int bounceNum) {
+    uint32_t path = current.path[ray];
+    auto [intersection, figure] = hits[ray].value();
+    const Color &emission = scene.materialOf(figure).emission;
+
+    if (bounceNum == 0) {
+        aov[path].depth = intersection.t * std::sqrt(current.direction[ray].len_square());
+        aov[path].emission = emission;
+    }
+    if (!isBlack(emission)) {
+        float weight = afterDiffuse[path]
+                       ? scene.emissionWeight(figure, current.direction[ray], intersection, lastDiffuse[path]) : 1;
+        radiance[path] = radiance[path] + weight * (throughput[path] * emission);
+    }
+    afterDiffuse[path] = false;
+}
+
+void Wavefront::shadeMissed(int bounceNum) {
+    int size = missed.size();
+#pragma omp parallel for schedule(static)
+    for (int k = 0; k < size; k++) {
+        uint32_t path = current.path[missed[k]];
+        radiance[path] = radiance[path] + throughput[path] * scene.bgColor;
+        if (bounceNum == 0) {
+            aov[path].emission = scene.bgColor;
+        }
+    }
+}
+
+void Wavefront::shadeSpecular(const std::vector<uint32_t> &rays, int bounceNum) {
+    int size = rays.size();
+#pragma omp parallel for schedule(dynamic, 64)
+    for (int k = 0; k < size; k++) {
+        uint32_t ray = rays[k], path = current.path[ray];
+        samplers[path].setBounce(bounceNum + 1);
+        addEmission(ray, bounceNum);
+
+        auto [intersection, figure] = hits[ray].value();
+        Ray r(current.origin[ray], current.direction[ray]);
+        if (scene.scatterSpecular(scene.materialOf(figure), intersection, samplers[path], r, throughput[path]) &&
+            Scene::survivesRoulette(bounceNum, samplers[path], throughput[path])) {
+            next.push(r.o, r.d, path);
+        }
+    }
+}
+
+void Wavefront::shadeDiffuse(int bounceNum) {
+    int size = diffuse.size();
+#pragma omp parallel for schedule(dynamic, 64)
+    for (int k = 0; k < size; k++) {
+        uint32_t ray = diffuse[k], path = current.path[ray];
+        Sampler &sampler = samplers[path];
+        sampler.setBounce(bounceNum + 1);
+        addEmission(ray, bounceNum);
+
+        auto [intersection, figure] = hits[ray].value();
+        const MaterialData &object = scene.materialOf(figure);
+        Point normal = intersection.norma;
+        if (recordAOV[path]) {
+            aov[path].albedo = throughput[path] * object.color;
+            aov[path].normal = normal;
+            recordAOV[path] = false;
+        }
+        if (isBlack(object.color)) {
+            continue;
+        }
+
+        Point origin = current.origin[ray] + intersection.t * current.direction[ray] + 0.0001f * normal;
+        Color albedo = throughput[path] * object.color;
+
+        auto lightSample = scene.sampleNextEvent(sampler, bounceNum, origin, normal);
+        if (lightSample.has_value()) {
+            shadow.push(origin, normal, lightSample.value(), albedo, path);
+        }
+
+        Point w = scene.diffuse.sample(sampler, origin, normal);
+        if (w * normal < 0) {
+            continue;
+        }
+        throughput[path] = albedo;
+        afterDiffuse[path] = true;
+        lastDiffuse[path] = DiffuseVertex{origin, normal, scene.diffuse.pdf(origin, normal, w)};
+        if (Scene::survivesRoulette(bounceNum, sampler, throughput[path])) {
+            next.push(origin, w, path);
+        }
+    }
+}
+
+void Wavefront::traceShadows() {
+    int size = shadow.rays.size;
+#pragma omp parallel for schedule(dynamic, 64)
+    for (int i = 0; i < size; i++) {
+        const Point &origin = shadow.rays.origin[i];
+        if (scene.occluded(Ray(origin, shadow.rays.direction[i]), Scene::SHADOW_FRACTION * shadow.sample[i].distance)) {
+            continue;
+        }
+        // A path queues at most one shadow ray per bounce, so nothing else
+        // writes its radiance here.
+        uint32_t path = shadow.rays.path[i];
+        radiance[path] = radiance[path] +
+                         scene.nextEventContribution(shadow.sample[i], origin, shadow.normal[i], shadow.albedo[i]);
+    }
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+#include "film.h"
+#include "sampler.h"
+#include "scene.h"
+
+// Breadth-first alternative to Scene::getPixelColor (Laine et al. 2013): a batch
+// of paths advances one bounce at a time, and every bounce runs as separate
+// stages over whole queues: sort the rays, find their closest hits, shade the
+// hits of each material in turn and trace the shadow rays that shading queued.
+// Each stage is a tight loop over one kind of work, so its code and data stay
+// in cache. Paths draw their random numbers in the same order as in
+// getPixelColor, so both give the same image.
+class Wavefront {
+public:
+    Wavefront(const Scene &scene, int batch);
+
+    // Renders the samples [film.count, passEnd) of the given pixels into film.
+    void render(Film &film, const std::vector<int> &pixels, int passEnd);
+
+private:
+    // Rays with one slot per path of the batch, filled from several threads.
+    struct RayQueue {
+        std::vector<Point> origin, direction;
+        std::vector<uint32_t> path;
+        std::atomic<uint32_t> size{0};
+
+        explicit RayQueue(int capacity);
+        void push(const Point &o, const Point &d, uint32_t pathIndex);
+    };
+
+    // Shadow rays also carry the light sample and the albedo at their origin.
+    struct ShadowQueue {
+        RayQueue rays;
+        std::vector<Point> normal;
+        std::vector<LightSample> sample;
+        std::vector<Color> albedo;
+
+        explicit ShadowQueue(int capacity);
+        void push(const Point &o, const Point &n, const LightSample &lightSample, const Color &color,
+                  uint32_t pathIndex);
+    };
+
+    const Scene &scene;
+    int batch;
+
+    // State of the paths in flight, one entry per path.
+    std::vector<int> pixel;
+    std::vector<Sampler> samplers;
+    std::vector<Color> throughput, radiance;
+    std::vector<SurfaceAOV> aov;
+    // Whether the path has not reached a diffuse surface for the AOVs yet.
+    std::vector<uint8_t> recordAOV;
+    // Whether the current ray left a diffuse vertex, which is then kept in lastDiffuse.
+    std::vector<uint8_t> afterDiffuse;
+    std::vector<DiffuseVertex> lastDiffuse;
+
+    RayQueue current, next;
+    ShadowQueue shadow;
+    // Closest hits of the current queue, parallel to it.
+    std::vector<std::optional<std::pair<Intersection, int>>> hits;
+    // Sort keys of the current queue and the bucket offsets of the counting sort.
+    static constexpr uint32_t SORT_GRID = 16;
+    static constexpr uint32_t SORT_KEYS = 8 * SORT_GRID * SORT_GRID * SORT_GRID;
+    std::vector<uint32_t> keys;
+    std::vector<uint32_t> offsets;
+    // Indices into the current queue of the rays to shade, one list per kind of hit.
+    std::vector<uint32_t> missed, metallic, dielectric, diffuse;
+
+    void generate(const std::vector<std::pair<int, int>> &work);
+    void sortRays();
+    void extend();
+    void classify();
+    void shadeMissed(int bounceNum);
+    void shadeSpecular(const std::vector<uint32_t> &rays, int bounceNum);
+    void shadeDiffuse(int bounceNum);
+    void traceShadows();
+    // Adds the emission of the hit surface, MIS weighted where needed.
+    void addEmission(uint32_t ray, int bounceNum);
+};